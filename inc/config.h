@@ -40,8 +40,46 @@
 #define CONFIG_DB5_HDR_FILE	"DB5000.HDR"
 /** @brief database indexes filename format - utf8 */
 #define CONFIG_DB5_IDX_FILE	"DB5000_%c%c%c%c.IDX"
+/** @brief database index fingerprints filename - utf8 */
+#define CONFIG_DB5_SUM_FILE	"DB5000.SUM"
+/** @brief database journal filename - utf8 */
+#define CONFIG_DB5_JNL_FILE	"DB5000.JNL"
 /** @brief database names filename - utf8 */
 #define CONFIG_NAMES_FILE	"Names.txt"
+/** @brief initial number of buckets of names hash tables, a power of 2 */
+#define CONFIG_NAMES_BUCKETS	256
+/** @brief names file is compacted when this percentage of its records are dead */
+#define CONFIG_NAMES_GARBAGE_RATIO	50
+/** @brief maximum delay, in seconds, before modified names are written back */
+#define CONFIG_NAMES_SAVE_DELAY	5
+
+/** @brief number of rows reserved at once when database data mapping grows */
+#define CONFIG_DB5_DAT_MAP_CHUNK	1024
+/** @brief maximum delay, in seconds, before modified database rows are written back */
+#define CONFIG_DB5_DAT_WRITEBACK_DELAY	30
+/** @brief number of deleted database rows kept hidden before database is compacted, 0 to compact on each delete */
+#define CONFIG_DB5_DAT_TOMBSTONES	512
+/** @brief number of rows allocated at once on disk when database data file grows, 0 to disable */
+#define CONFIG_DB5_DAT_PREALLOC	256
+
+/** @brief maximum delay, in seconds, before a modified row count is written to meta-database */
+#define CONFIG_DB5_HDR_WRITE_DELAY	30
+/** @brief 1 to write row count to meta-database on each modification, 0 to defer it */
+#define CONFIG_DB5_HDR_STRICT	0
+
+/** @brief number of threads generating index files, 0 for one per processor */
+#define CONFIG_DB5_INDEX_THREADS	0
+/** @brief delay, in seconds, without modification before index files are written in background, 0 to disable */
+#define CONFIG_DB5_INDEX_IDLE_DELAY	10
+/** @brief memory budget, in bytes, to sort indexes - larger databases are sorted on disk, without in-memory indexes */
+#define CONFIG_DB5_INDEX_MEMORY	67108864
+
+/** @brief size in bytes of pending journal records that triggers a commit */
+#define CONFIG_DB5_JOURNAL_GROUP_SIZE	65536
+/** @brief maximum delay, in seconds, between two journal commits */
+#define CONFIG_DB5_JOURNAL_GROUP_DELAY	5
+/** @brief size in bytes of journal file that triggers a checkpoint */
+#define CONFIG_DB5_JOURNAL_CHECKPOINT	1048576
 
 #endif
 
@@ -21,6 +21,22 @@ bool db5_init();
  */
 void db5_free();
 
+/**
+ * @brief write database modifications to disk
+ * @return true if successfull
+ */
+bool db5_sync();
+
+/**
+ * @brief start an operation, modifications done until db5_end are journaled together - operations are serialized
+ */
+void db5_begin();
+
+/**
+ * @brief end an operation started by db5_begin
+ */
+void db5_end();
+
 /**
  * @brief convert all strings of an entry to char
  * @param entry to use/edit
@@ -66,6 +82,28 @@ char **db5_select_filename();
  */
 bool db5_index();
 
+/**
+ * @brief find rows by artist, album, genre or title
+ * @param code index code of column, DB5_IDX_CODE_ARTIST for instance
+ * @param value searched value - utf8
+ * @param prefix true to find values starting by value, false to find value exactly
+ * @param positions receives positions of rows, to be freed - NULL if no row is found
+ * @param count receives number of rows found
+ * @return true if successfull
+ */
+bool db5_select_rows(const uint32_t code, const char *value, const bool prefix, uint32_t **positions, uint32_t *count);
+
+/**
+ * @brief start writing index files in background, once database is not modified for a while
+ * @return true if successfull
+ */
+bool db5_idle_start();
+
+/**
+ * @brief stop writing index files in background
+ */
+void db5_idle_stop();
+
 /**
  * @brief retrieve the local file name of a longname
  * @param filename longname to convert to local filename - utf8
@@ -16,6 +16,21 @@
  */
 #define DB5_ROW_NOT_FOUND	((uint32_t)-1)
 
+/**
+ * @brief row cache statistics
+ */
+typedef struct
+{
+	/** @brief row writes absorbed by the cache (row already dirty or unchanged) */
+	uint32_t hits;
+	/** @brief row writes that made a clean row dirty */
+	uint32_t misses;
+	/** @brief write operations done by write-back */
+	uint32_t writebacks;
+	/** @brief rows written by write-back */
+	uint32_t rows_written;
+} db5_dat_stats;
+
 /**
  * @brief initialize databse
  * @return true if is successfull
@@ -27,6 +42,53 @@ bool db5_dat_init();
  */
 void db5_dat_free();
 
+/**
+ * @brief write dirty rows back and flush database to disk
+ * @return true if is successfull
+ */
+bool db5_dat_sync();
+
+/**
+ * @brief get row cache statistics
+ * @param stats where statistics are stored
+ */
+void db5_dat_cache_stats(db5_dat_stats *stats);
+
+/**
+ * @brief write modified entries back when they are kept in memory for too long
+ */
+void db5_dat_timer();
+
+/**
+ * @brief set number of rows allocated at once on disk when database file grows
+ * @param rows number of rows, 0 to disable preallocation
+ */
+void db5_dat_set_prealloc(const uint32_t rows);
+
+/**
+ * @brief lock database for reading, entries can be accessed with db5_dat_row and db5_dat_deleted
+ */
+void db5_dat_read_lock();
+
+/**
+ * @brief unlock database locked by db5_dat_read_lock
+ */
+void db5_dat_read_unlock();
+
+/**
+ * @brief get an entry into database without copying it - database must be locked for reading
+ * @param index entry position
+ * @return entry in database mapping, NULL if out of database - valid until database is unlocked
+ */
+const db5_row *db5_dat_row(const uint32_t index);
+
+/**
+ * @brief get a decoded entry, strings are latin1 - database must be locked for reading
+ * @param index entry position
+ * @return decoded entry, NULL if out of database - valid until database is unlocked
+ */
+const db5_row *db5_dat_decoded_row(const uint32_t index);
+
 /**
  * @brief read an entry into database
  * @param index entry position
@@ -35,6 +97,14 @@ void db5_dat_free();
  */
 bool db5_dat_select_row(const uint32_t index, db5_row *entry);
 
+/**
+ * @brief read a decoded entry into database, strings are latin1
+ * @param index entry position
+ * @param entry read entry
+ * @return true if is successfull
+ */
+bool db5_dat_select_decoded(const uint32_t index, db5_row *entry);
+
 /**
  * @brief modify an entry into database
  * @param index entry position
@@ -51,12 +121,61 @@ bool db5_dat_update(const uint32_t index, db5_row *entry);
 bool db5_dat_insert(db5_row *entry);
 
 /**
- * @brief delete an entry of database
+ * @brief add several entries into database, meta-database is updated once
+ * @param entries new entries
+ * @param number number of entries
+ * @return true if is successfull
+ */
+bool db5_dat_insert_many(db5_row *entries, const uint32_t number);
+
+/**
+ * @brief delete an entry of database - entry is only hidden until next compaction
  * @param index entry position
  * @return true if is successfull
  */
 bool db5_dat_delete_row(const uint32_t index);
 
+/**
+ * @brief remove deleted entries from database file, moving last entries in their place
+ * @return true if is successfull
+ */
+bool db5_dat_compact();
+
+/**
+ * @brief write an entry at a given position, growing database file if needed (journal recovery)
+ * @param index entry position
+ * @param entry entry to write
+ * @return true if is successfull
+ */
+bool db5_dat_restore_row(const uint32_t index, const db5_row *entry);
+
+/**
+ * @brief hide an entry without compaction, ignoring entries already deleted (journal recovery)
+ * @param index entry position
+ * @return true if is successfull
+ */
+bool db5_dat_restore_delete(const uint32_t index);
+
+/**
+ * @brief set number of entries, resizing database file (journal recovery)
+ * @param count number of entries
+ * @return true if is successfull
+ */
+bool db5_dat_restore_count(const uint32_t count);
+
+/**
+ * @brief get the number of entries, deleted entries excluded
+ * @return number of entries
+ */
+uint32_t db5_dat_count();
+
+/**
+ * @brief test if an entry is deleted and waiting for compaction - database must be locked for reading
+ * @param index entry position
+ * @return true if entry is deleted
+ */
+bool db5_dat_deleted(const uint32_t index);
+
 /**
  * @brief find a row corresponding to a file
  * @param filename the local filename - latin1
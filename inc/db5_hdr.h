@@ -14,6 +14,9 @@
 
 #include "db5_types.h"
 
+/** @brief Offset of row count in database meta-data file */
+#define DB5_HDR_COUNT_OFFSET	1040
+
 /**
  * @brief initialize meta-database
  * @return true if successfull
@@ -27,13 +30,30 @@ bool db5_hdr_init();
 bool db5_hdr_free();
 
 /**
- * @brief get current row count
+ * @brief write modified row count to meta-database file
+ * @return true if successfull
+ */
+bool db5_hdr_flush();
+
+/**
+ * @brief write modified row count and flush meta-database to disk
+ * @return true if successfull
+ */
+bool db5_hdr_sync();
+
+/**
+ * @brief write modified row count when it is kept in memory for too long
+ */
+void db5_hdr_timer();
+
+/**
+ * @brief get current row count, guarded by the lock of database data
  * @return count of row in database
  */
 uint32_t db5_hdr_count();
 
 /**
- * @brief update row number in meta-database
+ * @brief update row number, written to meta-database on next flush
  * @param delta the value to add to current count
  * @return true if successfull
  */
@@ -36,6 +36,110 @@
 /** @brief source index	- ascii - not null terminated */
 #define DB5_IDX_CODE_SOURCE	0x43525358 /* 'XSRC' */
 
+/** @brief lookup result: rows were looked up */
+#define DB5_INDEX_SELECT_OK		0
+/** @brief lookup result: database is too large for in-memory tables, rows must be scanned */
+#define DB5_INDEX_SELECT_UNAVAILABLE	1
+/** @brief lookup result: lookup failed */
+#define DB5_INDEX_SELECT_ERROR		2
+
+/** @brief copy of modified in-memory tables, written without database lock */
+typedef struct db5_index_snapshot db5_index_snapshot;
+
+/**
+ * @brief sort all columns into in-memory tables, unless database is too large for them - database must be locked for reading
+ * @return true if successfull
+ */
+bool db5_index_init();
+
+/**
+ * @brief free in-memory tables
+ */
+void db5_index_free();
+
+/**
+ * @brief add a row to in-memory tables - database must be locked for writing
+ * @param position row position
+ */
+void db5_index_insert_row(const uint32_t position);
+
+/**
+ * @brief remove a row from in-memory tables, before it is modified - database must be locked for writing
+ * @param position row position
+ */
+void db5_index_remove_row(const uint32_t position);
+
+/**
+ * @brief update a row in in-memory tables, before it is modified - database must be locked for writing
+ * @param position row position
+ * @param row the new row
+ */
+void db5_index_update_row(const uint32_t position, const db5_row *row);
+
+/**
+ * @brief drop in-memory tables, all columns are sorted again on next indexing - database must be locked for writing
+ */
+void db5_index_invalidate();
+
+/**
+ * @brief find rows by value of a string column, using in-memory tables - database must be locked for reading
+ * @param code index code of column, DB5_IDX_CODE_ARTIST for instance
+ * @param value searched value - latin1
+ * @param prefix true to find values starting by value, false to find value exactly
+ * @param positions receives positions of rows, in index order, to be freed - NULL if no row is found
+ * @param count receives number of rows found
+ * @return DB5_INDEX_SELECT_OK, DB5_INDEX_SELECT_UNAVAILABLE if database is too large for in-memory tables, or DB5_INDEX_SELECT_ERROR
+ */
+int db5_index_select(const uint32_t code, const char *value, const bool prefix, uint32_t **positions, uint32_t *count);
+
+/**
+ * @brief find rows by value of a string column, scanning database rows - database must be locked for reading
+ * @param code index code of column, DB5_IDX_CODE_ARTIST for instance
+ * @param value searched value - latin1
+ * @param prefix true to find values starting by value, false to find value exactly
+ * @param positions receives positions of rows, in index order, to be freed - NULL if no row is found
+ * @param count receives number of rows found
+ * @return true if successfull
+ */
+bool db5_index_scan(const uint32_t code, const char *value, const bool prefix, uint32_t **positions, uint32_t *count);
+
+/**
+ * @brief copy in-memory tables modified since their index file was written - database must be locked for reading
+ * @return the copy, or NULL if there is nothing to write or tables are out of date
+ */
+db5_index_snapshot *db5_index_snapshot_take();
+
+/**
+ * @brief write index files of a copy of tables, then free it - database must not be locked
+ * @param snapshot the copy of tables
+ * @return true if successfull
+ */
+bool db5_index_snapshot_write(db5_index_snapshot *snapshot);
+
+/**
+ * @brief free a copy of tables
+ * @param snapshot the copy of tables
+ */
+void db5_index_snapshot_free(db5_index_snapshot *snapshot);
+
+/**
+ * @brief get number of bytes written to index file of a column, identical files are not written
+ * @param code index code
+ * @return bytes written since indexes were initialized
+ */
+uint64_t db5_index_bytes_written(const uint32_t code);
+
+/**
+ * @brief sort fixed-width keys as index files are sorted
+ * @param data keys, one per row
+ * @param size size of a key
+ * @param count number of keys
+ * @param positions receives positions of keys, in sorted order
+ * @param radix use radix sort, else qsort
+ * @return true if successfull
+ */
+bool db5_index_sort_keys(const char *data, const size_t size, const uint32_t count, uint32_t *positions, const bool radix);
+
 /**
  * @brief index a column (system)
  * @param reloffset element address in structure line
@@ -45,6 +149,13 @@
  */
 bool db5_index_index_column(const ptrdiff_t reloffset, const size_t size, const uint32_t code);
 
+/**
+ * @brief write index files of modified columns from in-memory tables, or sort all columns if tables are out of date
+ *        - database must be locked for reading
+ * @return true if successfull
+ */
+bool db5_index_index_all();
+
 /**
  * @brief index a string column (user friendly)
  * @param member element in structure line
@@ -0,0 +1,105 @@
+/**
+ * @file db5_journal.h
+ * @brief Header - Database db5, write-ahead journal
+ * @author Julien Blitte
+ * @version 0.1
+ */
+#ifndef INC_DB5_JOURNAL_H
+#define INC_DB5_JOURNAL_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db5_types.h"
+
+/** @brief journal record: row image, index is row position */
+#define DB5_JOURNAL_ROW		1
+/** @brief journal record: row deleted, index is row position */
+#define DB5_JOURNAL_DELETE	2
+/** @brief journal record: row count, index is the new count */
+#define DB5_JOURNAL_COUNT	4
+/** @brief journal record: name inserted, data is longname - latin1 */
+#define DB5_JOURNAL_NAME_INSERT	5
+/** @brief journal record: name deleted, data is longname - latin1 */
+#define DB5_JOURNAL_NAME_DELETE	6
+/** @brief journal record: end of a group of committed records */
+#define DB5_JOURNAL_COMMIT	7
+
+/**
+ * @brief open journal
+ * @return true if successfull
+ */
+bool db5_journal_init();
+
+/**
+ * @brief close journal, records not commited are lost
+ */
+void db5_journal_free();
+
+/**
+ * @brief apply commited records of journal to database (after a crash)
+ * @return number of applied records
+ */
+uint32_t db5_journal_replay();
+
+/**
+ * @brief start an operation, records of an operation are commited together
+ */
+void db5_journal_begin();
+
+/**
+ * @brief end an operation, records may be commited if enought are pending
+ */
+void db5_journal_end();
+
+/**
+ * @brief tell if an operation is running, its records are not commited yet
+ * @return true if an operation is running
+ */
+bool db5_journal_active();
+
+/**
+ * @brief log a row image
+ * @param index row position
+ * @param row the new row
+ */
+void db5_journal_row(const uint32_t index, const db5_row *row);
+
+/**
+ * @brief log a row deletion
+ * @param index row position
+ */
+void db5_journal_delete(const uint32_t index);
+
+/**
+ * @brief log a new row count
+ * @param count the new count
+ */
+void db5_journal_count(const uint32_t count);
+
+/**
+ * @brief log a modification of names database
+ * @param type DB5_JOURNAL_NAME_INSERT or DB5_JOURNAL_NAME_DELETE
+ * @param longname name inserted or deleted
+ */
+void db5_journal_name(const uint32_t type, const char *longname);
+
+/**
+ * @brief write pending records of finished operations and flush them to disk
+ * @return true if successfull
+ */
+bool db5_journal_commit();
+
+/**
+ * @brief empty the journal, once all database files are flushed to disk
+ * @return true if successfull
+ */
+bool db5_journal_checkpoint();
+
+/**
+ * @brief get size of commited records in journal file
+ * @return size of journal file
+ */
+uint32_t db5_journal_size();
+
+#endif
+
@@ -28,6 +28,13 @@ off_t file_filesize(const char *filename);
  */
 off_t file_filesize_f(FILE *f);
 
+/**
+ * @brief get size of an opened file descriptor
+ * @param fd an opened file descriptor
+ * @result size of file
+ */
+off_t file_filesize_d(const int fd);
+
 /**
  * @brief modify path to directory, file and extension string - path is destroyed
  * @param path the path to explode in directory, file and extension - destroyed - utf8 or latin1
@@ -80,6 +87,32 @@ void file_windows_slashes(char *path);
  */
 FILE *file_fcaseopen(const char *directory, const char *filename, const char *mode);
 
+/**
+ * @brief open the first file that match to specified filename without case sensitivity
+ * @param directory the directory where file must be found - utf8
+ * @param filename the filename to try to find - utf8
+ * @param flags open flags
+ * @return file descriptor or -1 if not found and file cannot be created
+ */
+int file_caseopen(const char *directory, const char *filename, const int flags);
+
+/**
+ * @brief rename a file without case sensitivity, an existing file with new name is replaced
+ * @param directory the directory of the file - utf8
+ * @param oldname current filename - utf8
+ * @param newname new filename - utf8
+ * @return true if successfull
+ */
+bool file_caserename(const char *directory, const char *oldname, const char *newname);
+
+/**
+ * @brief remove a file without case sensitivity
+ * @param directory the directory of the file - utf8
+ * @param filename the filename to remove - utf8
+ * @return true if successfull
+ */
+bool file_caseremove(const char *directory, const char *filename);
+
 /**
  * @brief truncate a file
  * @param f file to truncate
@@ -20,9 +20,11 @@ bool names_init();
 /**
  * @brief convert short name to longname
  * @param shortname name to convert to longname - latin1
- * @return longname or NULL if error - latin1
+ * @param longname buffer where longname is stored, shortname if not found - latin1
+ * @param longname_size size of longname
+ * @return true if shortname is found in names list
  */
-const char *names_select_longname(const char *shortname);
+bool names_select_longname(const char *shortname, char *longname, const size_t longname_size);
 
 /**
  * @brief convert long name to shortname
@@ -40,13 +42,19 @@ bool names_generate_shortname(const char *longname, char *shortname, const size_
 bool names_save();
 
 /**
- * @brief add an entry in names list
+ * @brief save names data on file and flush it to disk
+ * @return true if successfull
+ */
+bool names_sync();
+
+/**
+ * @brief add an entry in names list, saved later with other modifications
  * @param filename longname to remove - latin1
  */
 void names_insert(const char *filename);
 
 /**
- * @brief delete an entry in names list
+ * @brief delete an entry in names list, saved later with other modifications
  * @param filename longname to remove - latin1
  * @return true if successfull
  */
@@ -58,7 +66,7 @@ bool names_delete(const char *filename);
 void names_print();
 
 /**
- * @brief free names list
+ * @brief save names data, then free names list
  */
 void names_free();
 
@@ -0,0 +1,1051 @@
+/**
+ * @file bench.c
+ * @brief Source - Database db5, benchmarks
+ * @author Julien Blitte
+ * @version 0.1
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "config.h"
+#include "crc32.h"
+#include "db5.h"
+#include "db5_dat.h"
+#include "db5_hdr.h"
+#include "db5_index.h"
+#include "db5_journal.h"
+#include "db5_types.h"
+#include "file.h"
+#include "logger.h"
+#include "names.h"
+#include "wstring.h"
+
+/** @brief temporary file written between inserts, to compete with database for disk space */
+#define BENCH_FILLER_FILE	"bench.tmp"
+/** @brief file where crash check stores expected database content, checked by replay */
+#define BENCH_EXPECT_FILE	"bench.expect"
+
+/** @brief get n-th byte of an object */
+#define byteof(c,i) (((char *)&c)[(i)])
+
+/**
+ * @brief get a monotonic date
+ * @return date in seconds
+ */
+static double bench_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec/1e9;
+}
+
+/**
+ * @brief count extents of a database file
+ * @param filename database filename - utf8
+ * @return number of extents, -1 if filesystem does not report them
+ */
+static int bench_extents(const char *filename)
+{
+	struct fiemap map;
+	int fd, result;
+
+	fd = file_caseopen(CONFIG_DB5_DATA_DIR, filename, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	/* no extent buffer: only the number of extents is returned */
+	memset(&map, 0, sizeof(map));
+	map.fm_length = FIEMAP_MAX_OFFSET;
+	map.fm_flags = FIEMAP_FLAG_SYNC;
+	map.fm_extent_count = 0;
+
+	result = (ioctl(fd, FS_IOC_FIEMAP, &map) == 0 ? (int)map.fm_mapped_extents : -1);
+
+	close(fd);
+
+	return result;
+}
+
+/**
+ * @brief insert rows one by one, as files copied to device would do
+ * @param rows number of rows to insert
+ * @param filler size of data written to another file after each insert
+ * @param prealloc number of rows preallocated on database growth
+ * @return true if successfull
+ */
+static bool bench_grow_pass(const uint32_t rows, const size_t filler, const uint32_t prealloc)
+{
+	char shortname[PATH_MAX];
+	char *data;
+	FILE *other;
+	db5_row row;
+	uint32_t first, i;
+	double start, elapsed;
+
+	data = (char *)calloc(1, filler+1);
+	other = file_fcaseopen(CONFIG_DB5_DATA_DIR, BENCH_FILLER_FILE, "wb");
+	if (data == NULL || other == NULL)
+	{
+		fprintf(stderr, "bench: unable to create filler file\n");
+		free(data);
+		return false;
+	}
+
+	db5_dat_set_prealloc(prealloc);
+	first = db5_hdr_count();
+
+	start = bench_now();
+	for(i=0; i < rows; i++)
+	{
+		memset(&row, 0, sizeof(row));
+		snprintf(shortname, sizeof(shortname), "bench%06u.mp3", i);
+		strncpy(row.filename, shortname, membersizeof(db5_row, filename)/2);
+		strncpy(row.title, shortname, membersizeof(db5_row, title)/2);
+		db5_widechar_row(&row);
+
+		if (!db5_dat_insert(&row))
+		{
+			fprintf(stderr, "bench: unable to insert row %u\n", i);
+			break;
+		}
+
+		/* interleave allocations of another file, then write rows back as a mounted device would */
+		if (filler > 0)
+		{
+			fwrite(data, filler, 1, other);
+			fflush(other);
+		}
+		if (i % 32 == 31)
+		{
+			fdatasync(fileno(other));
+			db5_dat_sync();
+		}
+	}
+	db5_dat_sync();
+	elapsed = bench_now() - start;
+
+	printf("grow, prealloc %4u rows: %u inserts in %.3f s (%.0f inserts/s), %d extents\n",
+		prealloc, i, elapsed, i/elapsed, bench_extents(CONFIG_DB5_DAT_FILE));
+
+	/* restore database */
+	for(; i > 0; i--)
+	{
+		db5_dat_delete_row(first+i-1);
+	}
+	db5_dat_compact();
+	db5_sync();
+
+	fclose(other);
+	free(data);
+	snprintf(shortname, sizeof(shortname), "%s/%s", CONFIG_DB5_DATA_DIR, BENCH_FILLER_FILE);
+	unlink(shortname);
+
+	return true;
+}
+
+/**
+ * @brief compare database growth with and without preallocation
+ * @param rows number of rows to insert
+ * @return true if successfull
+ */
+static bool bench_grow(const uint32_t rows)
+{
+	return bench_grow_pass(rows, 65536, 0) && bench_grow_pass(rows, 65536, CONFIG_DB5_DAT_PREALLOC);
+}
+
+/**
+ * @brief fill keys of a column with synthetic values
+ * @param data keys to fill
+ * @param size size of a key
+ * @param count number of keys
+ */
+static void bench_sort_keys(char *data, const size_t size, const uint32_t count)
+{
+	char name[PATH_MAX];
+	uint32_t i, track;
+
+	srand(count);
+	memset(data, 0, size*count);
+
+	for(i=0; i < count; i++)
+	{
+		if (size <= sizeof(uint32_t))
+		{
+			/* a few track numbers */
+			track = 1 + rand()%20;
+			memcpy(data+i*size, &track, size);
+		}
+		else
+		{
+			/* some artists are much more frequent than others */
+			snprintf(name, sizeof(name), "Artist %u", rand() % (1 + rand()%2000));
+			strncpy(data+i*size, name, size/2);
+			ws_atows(data+i*size, size);
+		}
+	}
+}
+
+/**
+ * @brief compare radix sort of index keys with qsort
+ * @param rows number of rows, 0 for 10k, 100k and 1M rows
+ * @return true if successfull
+ */
+static bool bench_sort(const uint32_t rows)
+{
+	static const uint32_t counts[] = { 10000, 100000, 1000000 };
+	static const size_t sizes[] = { membersizeof(db5_row, artist), membersizeof(db5_row, track) };
+	uint32_t *sorted_qsort, *sorted_radix;
+	uint32_t count;
+	char *data;
+	double start, qsort_time, radix_time;
+	unsigned int n, k;
+	bool same;
+
+	for(n=0; n < sizeof(counts)/sizeof(uint32_t); n++)
+	{
+		count = (rows > 0 ? rows : counts[n]);
+
+		for(k=0; k < sizeof(sizes)/sizeof(size_t); k++)
+		{
+			data = (char *)malloc(sizes[k]*count);
+			sorted_qsort = (uint32_t *)malloc(sizeof(uint32_t)*count);
+			sorted_radix = (uint32_t *)malloc(sizeof(uint32_t)*count);
+			if (data == NULL || sorted_qsort == NULL || sorted_radix == NULL)
+			{
+				fprintf(stderr, "bench: not enought memory for %u rows\n", count);
+				free(data), free(sorted_qsort), free(sorted_radix);
+				return false;
+			}
+
+			bench_sort_keys(data, sizes[k], count);
+
+			start = bench_now();
+			db5_index_sort_keys(data, sizes[k], count, sorted_qsort, false);
+			qsort_time = bench_now() - start;
+
+			start = bench_now();
+			db5_index_sort_keys(data, sizes[k], count, sorted_radix, true);
+			radix_time = bench_now() - start;
+
+			same = (memcmp(sorted_qsort, sorted_radix, sizeof(uint32_t)*count) == 0);
+
+			printf("sort, %2u bytes keys, %7u rows: qsort %.3f s, radix %.3f s (x%.1f)%s\n",
+				(unsigned int)sizes[k], count, qsort_time, radix_time, qsort_time/radix_time,
+				(same ? "" : ", ORDER DIFFERS"));
+
+			free(data), free(sorted_qsort), free(sorted_radix);
+
+			if (!same)
+			{
+				return false;
+			}
+		}
+
+		if (rows > 0)
+		{
+			break;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief create a device holding a synthetic database
+ * @param rows number of rows
+ * @return true if successfull
+ */
+static bool bench_index_generate(const uint32_t rows)
+{
+	static const char *genres[] = { "Rock", "Pop", "Jazz", "Classical", "Electronic", "Hip-Hop", "Blues", "Country",
+		"Metal", "Folk", "Reggae", "Soul", "Punk", "Soundtrack", "World", "Latin" };
+	static const char *words[] = { "Love", "Night", "Heart", "Dream", "Fire", "Rain", "Blue", "Home", "Road", "Light",
+		"Time", "Dance", "Summer", "River", "Gold", "Shadow", "Wild", "Star", "Song", "Stone" };
+	char header[DB5_HDR_COUNT_OFFSET+sizeof(uint32_t)];
+	uint32_t artists, artist, i;
+	db5_row row;
+	FILE *dat, *hdr, *names;
+	bool result;
+
+	mkdir("System", 0755);
+	mkdir(CONFIG_DB5_DATA_DIR, 0755);
+
+	dat = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_DAT_FILE, "wb");
+	hdr = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_HDR_FILE, "wb");
+	names = file_fcaseopen(".", CONFIG_NAMES_FILE, "wb");
+	result = (dat != NULL && hdr != NULL && names != NULL);
+
+	/* a few artists own most of the rows */
+	srand(rows);
+	artists = rows/12 + 1;
+	for(i=0; result && i < rows; i++)
+	{
+		artist = (uint32_t)((uint64_t)(rand()%artists) * (rand()%artists) / artists);
+
+		memset(&row, 0, sizeof(row));
+		snprintf(row.filepath, membersizeof(db5_row, filepath)/2, "MUSIC\\");
+		snprintf(row.filename, membersizeof(db5_row, filename)/2, "%08X.MP3", i*2654435761U);
+		snprintf(row.artist, membersizeof(db5_row, artist)/2, "Artist %u", artist);
+		snprintf(row.album, membersizeof(db5_row, album)/2, "Album %u of artist %u", rand()%5, artist);
+		snprintf(row.genre, membersizeof(db5_row, genre)/2, "%s", genres[(artist+rand()%2) % (sizeof(genres)/sizeof(char *))]);
+		snprintf(row.title, membersizeof(db5_row, title)/2, "%s %s %s",
+			words[rand() % (sizeof(words)/sizeof(char *))], words[rand() % (sizeof(words)/sizeof(char *))],
+			words[rand() % (sizeof(words)/sizeof(char *))]);
+		db5_widechar_row(&row);
+
+		row.track = 1 + rand()%15;
+		row.year = 1960 + rand()%60;
+		row.bitrate = 128000;
+		row.samplerate = 44100;
+		row.duration = 120 + rand()%300;
+		row.source = DB5_SOURCE_FILE;
+
+		result = (fwrite(&row, sizeof(row), 1, dat) == 1);
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header+DB5_HDR_COUNT_OFFSET, &rows, sizeof(rows));
+	result = result && (fwrite(header, sizeof(header), 1, hdr) == 1);
+
+	if (dat != NULL)
+	{
+		fclose(dat);
+	}
+	if (hdr != NULL)
+	{
+		fclose(hdr);
+	}
+	if (names != NULL)
+	{
+		fclose(names);
+	}
+
+	return result;
+}
+
+/** @brief index codes of all index files */
+static const uint32_t bench_codes[] = { DB5_IDX_CODE_FILENAME, DB5_IDX_CODE_FILEPATH, DB5_IDX_CODE_ALBUM,
+	DB5_IDX_CODE_GENRE, DB5_IDX_CODE_TITLE, DB5_IDX_CODE_ARTIST, DB5_IDX_CODE_TRACK, DB5_IDX_CODE_SOURCE,
+	DB5_IDX_CODE_DEV };
+
+/**
+ * @brief generate all indexes of a synthetic database, result is one line of key=value pairs
+ * @param rows number of rows
+ * @return true if successfull
+ */
+static bool bench_index_pass(const uint32_t rows)
+{
+	char filename[PATH_MAX];
+	struct rusage usage;
+	double start, opened, indexed;
+	unsigned int c;
+	bool result;
+
+	if (!bench_index_generate(rows))
+	{
+		fprintf(stderr, "bench: unable to generate database of %u rows\n", rows);
+		return false;
+	}
+
+	/* indexes of previous pass are not compared */
+	for(c=0; c < sizeof(bench_codes)/sizeof(uint32_t); c++)
+	{
+		snprintf(filename, sizeof(filename), CONFIG_DB5_IDX_FILE, byteof(bench_codes[c], 0), byteof(bench_codes[c], 1), byteof(bench_codes[c], 2), byteof(bench_codes[c], 3));
+		file_caseremove(CONFIG_DB5_DATA_DIR, filename);
+	}
+
+	/* indexes are sorted when database is opened, then written */
+	start = bench_now();
+	if (!db5_init())
+	{
+		fprintf(stderr, "bench: unable to open database of %u rows\n", rows);
+		return false;
+	}
+	opened = bench_now();
+	result = db5_index();
+	indexed = bench_now();
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	/* bytes are counted as written, an identical file is not written again */
+	printf("index rows=%u open_s=%.3f index_s=%.3f rows_per_s=%.0f peak_rss_kb=%ld",
+		rows, opened-start, indexed-opened, rows/(indexed-opened), usage.ru_maxrss);
+	for(c=0; c < sizeof(bench_codes)/sizeof(uint32_t); c++)
+	{
+		printf(" %c%c%c%c=%llu", byteof(bench_codes[c], 0), byteof(bench_codes[c], 1), byteof(bench_codes[c], 2), byteof(bench_codes[c], 3),
+			(unsigned long long)db5_index_bytes_written(bench_codes[c]));
+	}
+	printf("\n");
+
+	db5_free();
+
+	return result;
+}
+
+/**
+ * @brief run a benchmark pass for several sizes, each size in its own process
+ * @param device directory where data are generated
+ * @param rows size of the only pass, 0 for all sizes
+ * @param counts sizes of passes
+ * @param count number of sizes
+ * @param pass the benchmark pass
+ * @return true if successfull
+ */
+static bool bench_sizes(const char *device, const uint32_t rows, const uint32_t *counts, const unsigned int count, bool (*pass)(const uint32_t))
+{
+	unsigned int n;
+	pid_t child;
+	int status;
+	bool result;
+
+	mkdir(device, 0755);
+	if (file_set_context(device) != true)
+	{
+		fprintf(stderr, "bench: unable to reach device '%s'\n", device);
+		return false;
+	}
+
+	result = true;
+	for(n=0; result && n < count; n++)
+	{
+		/* peak memory of each size is measured alone */
+		fflush(stdout);
+		child = fork();
+		if (child == 0)
+		{
+			open_log();
+			status = pass(rows > 0 ? rows : counts[n]);
+			close_log();
+			exit(status ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+		result = (child != -1 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+		if (rows > 0)
+		{
+			break;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief measure index generation on synthetic databases, each size in its own process
+ * @param device directory where databases are generated
+ * @param rows number of rows, 0 for 1k, 10k and 100k rows
+ * @return true if successfull
+ */
+static bool bench_index(const char *device, const uint32_t rows)
+{
+	static const uint32_t counts[] = { 1000, 10000, 100000 };
+
+	return bench_sizes(device, rows, counts, sizeof(counts)/sizeof(uint32_t), bench_index_pass);
+}
+
+/**
+ * @brief modify rows of database as a user would: update some, delete others, insert copies
+ *        - an operation must be running
+ * @param seed selects modified rows, each seed modifies other rows
+ * @return true if successfull
+ */
+static bool bench_modify(const uint32_t seed)
+{
+	uint32_t count, i;
+	db5_row row;
+	bool result;
+
+	count = db5_hdr_count();
+	result = true;
+
+	for(i=seed%7; result && i < count; i += 7)
+	{
+		if (!db5_dat_deleted(i) && db5_dat_select_decoded(i, &row))
+		{
+			snprintf(row.artist, membersizeof(db5_row, artist)/2, "Artist %u", (i+seed)%97);
+			db5_widechar_row(&row);
+			result = db5_dat_update(i, &row);
+		}
+	}
+
+	for(i=seed%13; result && i < count; i += 13)
+	{
+		if (!db5_dat_deleted(i) && db5_dat_select_decoded(i, &row))
+		{
+			snprintf(row.title, membersizeof(db5_row, title)/2, "Copy %u of row %u", seed, i);
+			db5_widechar_row(&row);
+			result = db5_dat_insert(&row);
+		}
+	}
+
+	/* deleted rows are compacted once there are too many of them */
+	for(i=count-seed%11; result && i > 0; i -= (i > 11 ? 11 : i))
+	{
+		if (!db5_dat_deleted(i-1))
+		{
+			result = db5_dat_delete_row(i-1);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief compute a digest of live rows of database, independent of row order
+ * @param live receives number of live rows
+ * @return digest of rows
+ */
+static uint64_t bench_digest(uint32_t *live)
+{
+	uint32_t sum, mix, count, i, crc;
+
+	sum = mix = 0;
+	*live = 0;
+
+	db5_dat_read_lock();
+	count = db5_hdr_count();
+	for(i=0; i < count; i++)
+	{
+		if (!db5_dat_deleted(i))
+		{
+			crc = crc32((const char *)db5_dat_row(i), sizeof(db5_row));
+			sum += crc;
+			mix ^= crc*2654435761U;
+			(*live)++;
+		}
+	}
+	db5_dat_read_unlock();
+
+	return ((uint64_t)sum << 32) | mix;
+}
+
+/**
+ * @brief look rows up with in-memory indexes and by scanning rows, results must be the same
+ * @param rows number of rows
+ * @return true if successfull
+ */
+static bool bench_select_pass(const uint32_t rows)
+{
+	static const uint32_t codes[] = { DB5_IDX_CODE_ARTIST, DB5_IDX_CODE_ALBUM, DB5_IDX_CODE_TITLE, DB5_IDX_CODE_GENRE };
+	char value[PATH_MAX];
+	uint32_t *indexed, *scanned;
+	uint32_t indexed_count, scanned_count, lookups, found, differ, i;
+	unsigned int c;
+	double start, index_time, scan_time;
+	db5_row row;
+	bool prefix, result;
+
+	if (!bench_index_generate(rows) || !db5_init())
+	{
+		fprintf(stderr, "bench: unable to open database of %u rows\n", rows);
+		return false;
+	}
+
+	/* in-memory tables are then kept up to date by modifications */
+	db5_begin();
+	bench_modify(0);
+	db5_end();
+
+	lookups = found = differ = 0;
+	index_time = scan_time = 0;
+	result = true;
+	for(i=0; result && i < db5_hdr_count(); i += 1 + db5_hdr_count()/64)
+	{
+		if (!db5_dat_select_decoded(i, &row) || db5_dat_deleted(i))
+		{
+			continue;
+		}
+
+		for(c=0; result && c < sizeof(codes)/sizeof(uint32_t); c++)
+		{
+			/* exact values, then their first word */
+			prefix = (i % 2 == 1);
+			switch(codes[c])
+			{
+				case DB5_IDX_CODE_ARTIST: snprintf(value, sizeof(value), "%s", row.artist); break;
+				case DB5_IDX_CODE_ALBUM: snprintf(value, sizeof(value), "%s", row.album); break;
+				case DB5_IDX_CODE_TITLE: snprintf(value, sizeof(value), "%s", row.title); break;
+				default: snprintf(value, sizeof(value), "%s", row.genre); break;
+			}
+			if (prefix && strchr(value, ' ') != NULL)
+			{
+				*strchr(value, ' ') = '\0';
+			}
+
+			start = bench_now();
+			result = db5_select_rows(codes[c], value, prefix, &indexed, &indexed_count);
+			index_time += bench_now() - start;
+
+			start = bench_now();
+			db5_dat_read_lock();
+			result = db5_index_scan(codes[c], value, prefix, &scanned, &scanned_count) && result;
+			db5_dat_read_unlock();
+			scan_time += bench_now() - start;
+
+			if (indexed_count != scanned_count
+				|| (indexed_count > 0 && memcmp(indexed, scanned, sizeof(uint32_t)*indexed_count) != 0))
+			{
+				fprintf(stderr, "bench: lookup of '%s' differs, %u indexed rows, %u scanned rows\n", value, indexed_count, scanned_count);
+				differ++;
+			}
+
+			lookups++;
+			found += indexed_count;
+			free(indexed);
+			free(scanned);
+		}
+	}
+
+	printf("select rows=%u lookups=%u found=%u index_s=%.4f scan_s=%.4f (x%.0f)%s\n",
+		rows, lookups, found, index_time, scan_time, scan_time/(index_time > 0 ? index_time : 1e-9),
+		(differ > 0 ? ", RESULTS DIFFER" : ""));
+
+	db5_free();
+
+	return result && differ == 0;
+}
+
+/**
+ * @brief compare lookups using in-memory indexes with scans of database rows, each size in its own process
+ * @param device directory where databases are generated
+ * @param rows number of rows, 0 for 1k, 10k and 100k rows
+ * @return true if successfull
+ */
+static bool bench_select(const char *device, const uint32_t rows)
+{
+	static const uint32_t counts[] = { 1000, 10000, 100000 };
+
+	return bench_sizes(device, rows, counts, sizeof(counts)/sizeof(uint32_t), bench_select_pass);
+}
+
+/**
+ * @brief read index files of all columns
+ * @param contents receives content of each index file, to be freed
+ * @param sizes receives size of each index file
+ * @return true if successfull
+ */
+static bool bench_read_indexes(char **contents, off_t *sizes)
+{
+	char filename[PATH_MAX];
+	unsigned int c;
+	FILE *file;
+	bool result;
+
+	result = true;
+	for(c=0; c < sizeof(bench_codes)/sizeof(uint32_t); c++)
+	{
+		snprintf(filename, sizeof(filename), CONFIG_DB5_IDX_FILE, byteof(bench_codes[c], 0), byteof(bench_codes[c], 1), byteof(bench_codes[c], 2), byteof(bench_codes[c], 3));
+		contents[c] = NULL;
+		sizes[c] = 0;
+
+		file = file_fcaseopen(CONFIG_DB5_DATA_DIR, filename, "rb");
+		if (file == NULL)
+		{
+			result = false;
+			continue;
+		}
+
+		sizes[c] = file_filesize_f(file);
+		contents[c] = (char *)malloc(sizes[c] > 0 ? sizes[c] : 1);
+		result = (contents[c] != NULL && (sizes[c] == 0 || fread(contents[c], sizes[c], 1, file) == 1)) && result;
+		fclose(file);
+	}
+
+	return result;
+}
+
+/**
+ * @brief write index files from tables kept up to date by modifications, then from a full sort, files must be the same
+ * @param rows number of rows
+ * @return true if successfull
+ */
+static bool bench_rebuild_pass(const uint32_t rows)
+{
+	char *incremental[sizeof(bench_codes)/sizeof(uint32_t)], *rebuilt[sizeof(bench_codes)/sizeof(uint32_t)];
+	off_t incremental_sizes[sizeof(bench_codes)/sizeof(uint32_t)], rebuilt_sizes[sizeof(bench_codes)/sizeof(uint32_t)];
+	unsigned int c, differ;
+	uint32_t seed;
+	bool result;
+
+	if (!bench_index_generate(rows) || !db5_init())
+	{
+		fprintf(stderr, "bench: unable to open database of %u rows\n", rows);
+		return false;
+	}
+
+	/* tables are sorted once, then updated row by row */
+	result = db5_index();
+	for(seed=1; result && seed <= 3; seed++)
+	{
+		db5_begin();
+		result = bench_modify(seed);
+		db5_end();
+	}
+	result = result && db5_index() && bench_read_indexes(incremental, incremental_sizes);
+
+	db5_begin();
+	db5_index_invalidate();
+	db5_end();
+	result = result && db5_index() && bench_read_indexes(rebuilt, rebuilt_sizes);
+
+	differ = 0;
+	for(c=0; c < sizeof(bench_codes)/sizeof(uint32_t); c++)
+	{
+		if (result && (incremental_sizes[c] != rebuilt_sizes[c] || memcmp(incremental[c], rebuilt[c], incremental_sizes[c]) != 0))
+		{
+			fprintf(stderr, "bench: index '%c%c%c%c' differs from a full sort\n",
+				byteof(bench_codes[c], 0), byteof(bench_codes[c], 1), byteof(bench_codes[c], 2), byteof(bench_codes[c], 3));
+			differ++;
+		}
+		free(incremental[c]);
+		free(rebuilt[c]);
+	}
+
+	printf("rebuild rows=%u live=%u indexes=%u%s\n", rows, db5_count(), (unsigned int)(sizeof(bench_codes)/sizeof(uint32_t)),
+		(!result ? ", FAILED" : (differ > 0 ? ", INDEXES DIFFER" : "")));
+
+	db5_free();
+
+	return result && differ == 0;
+}
+
+/**
+ * @brief compare index files written from tables kept up to date with a full sort, each size in its own process
+ * @param device directory where databases are generated
+ * @param rows number of rows, 0 for 1k, 10k and 100k rows
+ * @return true if successfull
+ */
+static bool bench_rebuild(const char *device, const uint32_t rows)
+{
+	static const uint32_t counts[] = { 1000, 10000, 100000 };
+
+	return bench_sizes(device, rows, counts, sizeof(counts)/sizeof(uint32_t), bench_rebuild_pass);
+}
+
+/**
+ * @brief modify a synthetic database, then stop as a crash would: last operation is not finished
+ *        and journal ends with a partial record - content expected after recovery is saved for replay
+ * @param rows number of rows
+ * @return false on failure, process exits on success
+ */
+static bool bench_crash(const uint32_t rows)
+{
+	db5_row torn;
+	uint64_t digest;
+	uint32_t live;
+	FILE *expect;
+	int journal;
+	bool result;
+
+	if (!bench_index_generate(rows) || !db5_init())
+	{
+		fprintf(stderr, "bench: unable to open database of %u rows\n", rows);
+		return false;
+	}
+
+	/* commited operations must survive */
+	db5_begin();
+	result = bench_modify(1);
+	db5_end();
+	db5_begin();
+	result = result && bench_modify(2);
+	db5_end();
+	result = result && db5_journal_commit();
+
+	/* a checkpoint would leave nothing to replay */
+	if (result && db5_journal_size() == 0)
+	{
+		fprintf(stderr, "bench: journal of %u rows was checkpointed, use less rows\n", rows);
+		return false;
+	}
+
+	digest = bench_digest(&live);
+	expect = file_fcaseopen(".", BENCH_EXPECT_FILE, "wb");
+	result = result && expect != NULL && fprintf(expect, "%u %016llx\n", live, (unsigned long long)digest) > 0;
+	if (expect != NULL)
+	{
+		result = (fclose(expect) == 0) && result;
+	}
+
+	/* operation in progress is lost */
+	db5_begin();
+	result = result && bench_modify(3);
+
+	/* a row record is half written when power is lost */
+	memset(&torn, 0x5a, sizeof(torn));
+	journal = file_caseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_JNL_FILE, O_WRONLY|O_APPEND);
+	result = result && journal != -1 && write(journal, &torn, sizeof(torn)/2) == sizeof(torn)/2;
+	if (journal != -1)
+	{
+		close(journal);
+	}
+
+	if (!result)
+	{
+		fprintf(stderr, "bench: unable to prepare crash of database of %u rows\n", rows);
+		return false;
+	}
+
+	printf("crash rows=%u live=%u digest=%016llx journal=%u\n", rows, live, (unsigned long long)digest, db5_journal_size());
+	fflush(stdout);
+	close_log();
+
+	/* nothing is written back on exit */
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief open a database left by crash, once its journal is replayed content must be the one saved by crash
+ * @return true if successfull
+ */
+static bool bench_replay()
+{
+	unsigned long long expected_digest;
+	unsigned int expected_live;
+	uint64_t digest;
+	uint32_t live;
+	FILE *expect;
+	bool result;
+
+	expect = file_fcaseopen(".", BENCH_EXPECT_FILE, "rb");
+	result = (expect != NULL && fscanf(expect, "%u %llx", &expected_live, &expected_digest) == 2);
+	if (expect != NULL)
+	{
+		fclose(expect);
+	}
+	if (!result)
+	{
+		fprintf(stderr, "bench: no content expected, run crash first\n");
+		return false;
+	}
+
+	if (!db5_init())
+	{
+		fprintf(stderr, "bench: unable to open database\n");
+		return false;
+	}
+
+	digest = bench_digest(&live);
+	result = (live == expected_live && digest == expected_digest);
+
+	printf("replay live=%u expected=%u digest=%016llx expected=%016llx journal=%u%s\n", live, expected_live,
+		(unsigned long long)digest, expected_digest, db5_journal_size(), (result ? "" : ", CONTENT DIFFERS"));
+
+	db5_free();
+
+	return result;
+}
+
+/**
+ * @brief generate a synthetic names file
+ * @param entries number of entries
+ * @return true if successfull
+ */
+static bool bench_names_generate(const uint32_t entries)
+{
+	static const char *words[] = { "Love", "Night", "Heart", "Dream", "Fire", "Rain", "Blue", "Home", "Road", "Light",
+		"Time", "Dance", "Summer", "River", "Gold", "Shadow", "Wild", "Star", "Song", "Stone" };
+	char longname[PATH_MAX];
+	FILE *names;
+	uint32_t i;
+	bool result;
+
+	crc32_init();
+
+	names = file_fcaseopen(".", CONFIG_NAMES_FILE, "wb");
+	if (names == NULL)
+	{
+		return false;
+	}
+
+	srand(entries);
+	result = true;
+	for(i=0; result && i < entries; i++)
+	{
+		snprintf(longname, sizeof(longname), "Artist %u - %s %s %s (%u).mp3", rand() % (entries/12 + 1),
+			words[rand() % (sizeof(words)/sizeof(char *))], words[rand() % (sizeof(words)/sizeof(char *))],
+			words[rand() % (sizeof(words)/sizeof(char *))], i);
+
+		result = (fprintf(names, "%x.mp3\r\n%s\r\n", strcrc32(longname), longname) > 0);
+	}
+
+	fclose(names);
+
+	return result;
+}
+
+/**
+ * @brief load a synthetic names file, result is one line of key=value pairs
+ * @param entries number of entries
+ * @return true if successfull
+ */
+static bool bench_names_pass(const uint32_t entries)
+{
+	struct rusage usage;
+	double start, loaded, freed;
+	bool result;
+
+	if (!bench_names_generate(entries))
+	{
+		fprintf(stderr, "bench: unable to generate names file of %u entries\n", entries);
+		return false;
+	}
+
+	/* names are loaded when device is mounted */
+	start = bench_now();
+	result = names_init();
+	loaded = bench_now();
+	names_free();
+	freed = bench_now();
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("names entries=%u load_s=%.4f free_s=%.4f entries_per_s=%.0f size=%ld peak_rss_kb=%ld\n",
+		entries, loaded-start, freed-loaded, entries/(loaded-start), (long)file_filesize(CONFIG_NAMES_FILE), usage.ru_maxrss);
+
+	return result;
+}
+
+/**
+ * @brief measure names loading on synthetic names files, each size in its own process
+ * @param device directory where names files are generated
+ * @param entries number of entries, 0 for 10k and 100k entries
+ * @return true if successfull
+ */
+static bool bench_names(const char *device, const uint32_t entries)
+{
+	static const uint32_t counts[] = { 10000, 100000 };
+
+	return bench_sizes(device, entries, counts, sizeof(counts)/sizeof(uint32_t), bench_names_pass);
+}
+
+void usage()
+{
+	fprintf(stderr, "usage: bench.db5 <device> <benchmark> [count]\n\n");
+	fprintf(stderr, "  device     the path of db5 device, use a copy: database is modified\n");
+	fprintf(stderr, "  benchmark  one of:\n");
+	fprintf(stderr, "             grow   insert rows with and without preallocation of database file\n");
+	fprintf(stderr, "             sort   sort synthetic index keys with radix sort and qsort, device is not used\n");
+	fprintf(stderr, "             index  generate synthetic databases in device directory, then all their indexes\n");
+	fprintf(stderr, "             names  generate synthetic names files in device directory, then load them\n");
+	fprintf(stderr, "             select generate synthetic databases in device directory, then compare indexed lookups with scans\n");
+	fprintf(stderr, "             rebuild generate synthetic databases in device directory, modify them, then compare their\n");
+	fprintf(stderr, "             indexes with a full sort\n");
+	fprintf(stderr, "             crash  generate a synthetic database in device directory, modify it, then stop as a crash would\n");
+	fprintf(stderr, "             replay check that database left by crash recovers its commited content\n");
+	fprintf(stderr, "  count      number of rows (default 2000 for grow, 10k, 100k and 1M for sort, 1k, 10k and 100k for index,\n");
+	fprintf(stderr, "             select and rebuild, 3000 for crash, 10k and 100k for names)\n\n");
+
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t count;
+	bool result;
+
+	if (argc != 3 && argc != 4)
+	{
+		usage();
+	}
+
+	/* benchmarks without database */
+	if (strcmp(argv[2], "sort") == 0)
+	{
+		open_log();
+		result = bench_sort(argc == 4 ? strtoul(argv[3], NULL, 10) : 0);
+		close_log();
+		return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (strcmp(argv[2], "index") == 0)
+	{
+		result = bench_index(argv[1], argc == 4 ? strtoul(argv[3], NULL, 10) : 0);
+		return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (strcmp(argv[2], "select") == 0)
+	{
+		result = bench_select(argv[1], argc == 4 ? strtoul(argv[3], NULL, 10) : 0);
+		return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (strcmp(argv[2], "names") == 0)
+	{
+		result = bench_names(argv[1], argc == 4 ? strtoul(argv[3], NULL, 10) : 0);
+		return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (strcmp(argv[2], "rebuild") == 0)
+	{
+		result = bench_rebuild(argv[1], argc == 4 ? strtoul(argv[3], NULL, 10) : 0);
+		return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	/* checks opening database themselves */
+	if (strcmp(argv[2], "crash") == 0 || strcmp(argv[2], "replay") == 0)
+	{
+		mkdir(argv[1], 0755);
+		if (file_set_context(argv[1]) != true)
+		{
+			fprintf(stderr, "bench.db5: fatal, unable to reach device '%s'\n", argv[1]);
+			exit(EXIT_FAILURE);
+		}
+
+		open_log();
+		if (strcmp(argv[2], "crash") == 0)
+		{
+			result = bench_crash(argc == 4 ? strtoul(argv[3], NULL, 10) : 3000);
+		}
+		else
+		{
+			result = bench_replay();
+		}
+		close_log();
+		return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	count = (argc == 4 ? strtoul(argv[3], NULL, 10) : 2000);
+
+	if (file_set_context(argv[1]) != true)
+	{
+		fprintf(stderr, "bench.db5: fatal, unable to reach device '%s'\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	open_log();
+	if (db5_init() != true)
+	{
+		fprintf(stderr, "bench.db5: fatal, unable to initialize filesystem\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (strcmp(argv[2], "grow") == 0)
+	{
+		result = bench_grow(count);
+	}
+	else
+	{
+		usage();
+	}
+
+	db5_free();
+	close_log();
+
+	return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+}
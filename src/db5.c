@@ -5,10 +5,12 @@
  * @version 0.1
  */
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "asf.h"
@@ -18,6 +20,7 @@
 #include "db5_dat.h"
 #include "db5_hdr.h"
 #include "db5_index.h"
+#include "db5_journal.h"
 #include "db5_types.h"
 #include "file.h"
 #include "mp3.h"
@@ -25,6 +28,27 @@
 #include "utf8.h"
 #include "wstring.h"
 
+/** @brief Lock serializing database modifications */
+static pthread_mutex_t db5_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Date of last modification, protected by db5_write_lock */
+static time_t db5_change_date;
+
+/** @brief Date of last modification whose indexes were written in background, protected by db5_write_lock */
+static time_t db5_idle_date;
+
+/** @brief Background index writer */
+static pthread_t db5_idle_thread;
+
+/** @brief If background index writer is running */
+static bool db5_idle_running = false;
+
+/** @brief Lock of db5_idle_running */
+static pthread_mutex_t db5_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Signaled when background index writer must stop */
+static pthread_cond_t db5_idle_stopped = PTHREAD_COND_INITIALIZER;
+
 bool db5_init()
 {
 	if (db5_hdr_init() == false)
@@ -42,10 +66,91 @@ bool db5_init()
 		db5_dat_free();
 		return false;
 	}
+	if (db5_journal_init() == false)
+	{
+		db5_hdr_free();
+		db5_dat_free();
+		names_free();
+		return false;
+	}
+
+	/* redo operations commited before an unclean shutdown */
+	if (db5_journal_replay() > 0)
+	{
+		db5_sync();
+	}
+	else
+	{
+		db5_journal_checkpoint();
+	}
+
+	/* indexes are then kept up to date by each modification */
+	db5_dat_read_lock();
+	db5_index_init();
+	db5_dat_read_unlock();
 
 	return true;
 }
 
+/**
+ * @brief write all database files to disk, then empty journal, write lock must be held
+ * @return true if successfull
+ */
+static bool db5_sync_files()
+{
+	bool result;
+
+	/* journal first, database files are then written in any order */
+	result = db5_journal_commit();
+	result = result && db5_dat_sync();
+	result = result && db5_hdr_sync();
+	result = result && names_sync();
+
+	/* everything is on disk, journal can be emptied */
+	result = result && db5_journal_checkpoint();
+
+	return result;
+}
+
+bool db5_sync()
+{
+	bool result;
+
+	add_log(ADDLOG_DEBUG, "[db5]sync", "called\n");
+
+	pthread_mutex_lock(&db5_write_lock);
+	result = db5_sync_files();
+	pthread_mutex_unlock(&db5_write_lock);
+
+	return result;
+}
+
+void db5_begin()
+{
+	pthread_mutex_lock(&db5_write_lock);
+	db5_journal_begin();
+}
+
+void db5_end()
+{
+	bool checkpoint;
+
+	db5_change_date = time(NULL);
+	db5_journal_end();
+
+	/* records of operation are closed, modifications can reach database files */
+	db5_dat_timer();
+	db5_hdr_timer();
+
+	checkpoint = (db5_journal_size() >= CONFIG_DB5_JOURNAL_CHECKPOINT);
+	pthread_mutex_unlock(&db5_write_lock);
+
+	if (checkpoint)
+	{
+		db5_sync();
+	}
+}
+
 void db5_widechar_row(db5_row *row)
 {
 	check(row != NULL);
@@ -138,57 +243,89 @@ bool db5_generate_row(const char *localfile, db5_row *row)
 
 char **db5_select_filename()
 {
-	uint32_t count, i;
-	db5_row row;
+	uint32_t count, i, j;
+	const db5_row *entry;
 	char **result;
-	char filename[PATH_MAX];
+	char filename[PATH_MAX], longname[PATH_MAX];
 	
 	add_log(ADDLOG_DEBUG, "[db5]select_filename", "called\n");
 
+	/* rows must not move while they are listed */
+	db5_dat_read_lock();
+
 	count = db5_hdr_count();
 
 	result = (char **)malloc((count+1) * sizeof(char *));
 	if (result == NULL)
 	{
+		db5_dat_read_unlock();
 		add_log(ADDLOG_CRITICAL, "[db5]select_filename", "not enougth memory\n");
 		return NULL;
 	}
 
-	for(i=0; i < count; i++)
+	for(i=0, j=0; i < count; i++)
 	{
-		if (db5_dat_select_row(i, &row) != true)
+		/* row is waiting for compaction */
+		if (db5_dat_deleted(i))
+		{
+			continue;
+		}
+
+		entry = db5_dat_decoded_row(i);
+		if (entry == NULL)
 		{
+			db5_dat_read_unlock();
 			add_log(ADDLOG_FAIL, "[db5]select_filename", "unable to get file information form database, entry id: %u\n", i);
 			free(result);
 			return NULL;
 		}
-		/* ws_wstoa(row.filename, membersizeof(db5_row, filename)); */
-		db5_unwidechar_row(&row);
-
-		iso8859_utf8(names_select_longname(row.filename), filename, sizeof(filename));
+		names_select_longname(entry->filename, longname, sizeof(longname));
+		iso8859_utf8(longname, filename, sizeof(filename));
 
-		result[i] = (char *)malloc((strlen(filename)+1)*sizeof(char));
-		if (result[i] == NULL)
+		result[j] = (char *)malloc((strlen(filename)+1)*sizeof(char));
+		if (result[j] == NULL)
 		{
+			db5_dat_read_unlock();
 			add_log(ADDLOG_CRITICAL, "[db5]select_filename", "not enougth memory\n");
 			return NULL;
 		}
 
-		strcpy(result[i], filename);
+		strcpy(result[j], filename);
+		j++;
 	}
 
-	result[count] = NULL;
+	db5_dat_read_unlock();
 
-	add_log(ADDLOG_DUMP, "[db5]select_filename", "returns %u file(s)\n", count);
+	result[j] = NULL;
+
+	add_log(ADDLOG_DUMP, "[db5]select_filename", "returns %u file(s)\n", j);
 
 	return result;
 }
 
 void db5_free()
 {
+	db5_idle_stop();
+	db5_sync();
+
 	db5_hdr_free();
 	db5_dat_free();
 	names_free();
+	db5_index_free();
+	db5_journal_free();
+}
+
+/**
+ * @brief remove a name added by a failed insertion, so that the operation leaves nothing behind
+ * @param filename_latin1 the filename - latin1
+ * @param named true if name was added by the insertion
+ */
+static void db5_insert_cancel(const char *filename_latin1, const bool named)
+{
+	if (named && names_delete(filename_latin1))
+	{
+		db5_journal_name(DB5_JOURNAL_NAME_DELETE, filename_latin1);
+	}
 }
 
 bool db5_insert(const char *filename)
@@ -197,6 +334,7 @@ bool db5_insert(const char *filename)
 	char filename_latin1[PATH_MAX];
 	char localfile[PATH_MAX];
 	db5_row row;
+	bool named;
 
 	check(filename != NULL);
 
@@ -204,9 +342,12 @@ bool db5_insert(const char *filename)
 	utf8_iso8859(filename, filename_latin1, sizeof(filename_latin1));
 
 	/* test if file is already in names database, else add it */
+	named = false;
 	if (!names_select_shortname(filename_latin1, shortname, sizeof(shortname)))
 	{
 		names_insert(filename_latin1);
+		db5_journal_name(DB5_JOURNAL_NAME_INSERT, filename_latin1);
+		named = true;
 	}
 
 	/* file must be in names database now */
@@ -224,6 +365,7 @@ bool db5_insert(const char *filename)
 	if (db5_dat_select_by_filename(filename_latin1) != DB5_ROW_NOT_FOUND)
 	{
 		add_log(ADDLOG_FAIL, "[db5]insert", "file '%s' already exists\n", filename);
+		db5_insert_cancel(filename_latin1, named);
 		return false;
 	}
 
@@ -234,6 +376,7 @@ bool db5_insert(const char *filename)
 	if (db5_generate_row(localfile, &row) != true)
 	{
 		add_log(ADDLOG_FAIL, "[db5]insert", "unable to generate row from file '%s'\n", filename);
+		db5_insert_cancel(filename_latin1, named);
 		return false;
 	}
 	db5_widechar_row(&row);
@@ -245,6 +388,7 @@ bool db5_insert(const char *filename)
 	if (db5_dat_insert(&row) != true)
 	{
 		add_log(ADDLOG_FAIL, "[db5]insert", "unable to insert row in database '%s'\n", filename);
+		db5_insert_cancel(filename_latin1, named);
 		return false;
 	}
 
@@ -338,6 +482,10 @@ bool db5_delete(const char *filename)
 	}
 
 	if (names_delete(filename))
+	{
+		db5_journal_name(DB5_JOURNAL_NAME_DELETE, filename);
+	}
+	else
 	{
 		add_log(ADDLOG_RECOVER, "[db5]remove", "unable to remove file '%s' from names database\n", filename);
 	}
@@ -346,32 +494,162 @@ bool db5_delete(const char *filename)
 }
 
 
+bool db5_select_rows(const uint32_t code, const char *value, const bool prefix, uint32_t **positions, uint32_t *count)
+{
+	char value_latin1[PATH_MAX];
+	bool result;
+
+	check(value != NULL);
+
+	utf8_iso8859(value, value_latin1, sizeof(value_latin1));
+
+	db5_dat_read_lock();
+	switch(db5_index_select(code, value_latin1, prefix, positions, count))
+	{
+		case DB5_INDEX_SELECT_OK:
+			result = true;
+			break;
+		case DB5_INDEX_SELECT_UNAVAILABLE:
+			/* database is too large for in-memory tables */
+			result = db5_index_scan(code, value_latin1, prefix, positions, count);
+			break;
+		default:
+			result = false;
+			break;
+	}
+	db5_dat_read_unlock();
+
+	return result;
+}
+
 /**
- * @brief index a column and store result in a bitmap
- * @param bitmap the bitmap variable
- * @param item variable to index
- * @param code code of index
+ * @brief write database, then index files of modified columns, if database is idle
  */
-#define db5_index_col(bitmap, item, code)	bitmap <<= 1; if (db5_index_colindex(item, code)) { bitmap++; }
+static void db5_idle_index()
+{
+	db5_index_snapshot *snapshot;
+	time_t change_date;
+
+	pthread_mutex_lock(&db5_write_lock);
+	change_date = db5_change_date;
+	pthread_mutex_unlock(&db5_write_lock);
+
+	if (change_date == db5_idle_date || time(NULL) - change_date < CONFIG_DB5_INDEX_IDLE_DELAY)
+	{
+		return;
+	}
+
+	/* index files must match database file: no modification between write and copy of tables */
+	pthread_mutex_lock(&db5_write_lock);
+	if (!db5_sync_files())
+	{
+		pthread_mutex_unlock(&db5_write_lock);
+		add_log(ADDLOG_FAIL, "[db5]idle", "unable to write database, indexes are not written\n");
+		return;
+	}
+	db5_dat_read_lock();
+	snapshot = db5_index_snapshot_take();
+	db5_dat_read_unlock();
+	db5_idle_date = change_date;
+	pthread_mutex_unlock(&db5_write_lock);
+
+	/* files are written unlocked */
+	if (snapshot != NULL)
+	{
+		add_log(ADDLOG_DEBUG, "[db5]idle", "database is idle, writing indexes\n");
+		db5_index_snapshot_write(snapshot);
+	}
+}
+
+/**
+ * @brief background index writer
+ * @param arg unused
+ * @return NULL
+ */
+static void *db5_idle_worker(void *arg)
+{
+	struct timespec wakeup;
+
+	(void) arg;
+
+	pthread_mutex_lock(&db5_idle_lock);
+	while(db5_idle_running)
+	{
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += CONFIG_DB5_INDEX_IDLE_DELAY;
+		pthread_cond_timedwait(&db5_idle_stopped, &db5_idle_lock, &wakeup);
+
+		if (!db5_idle_running)
+		{
+			break;
+		}
+
+		pthread_mutex_unlock(&db5_idle_lock);
+		db5_idle_index();
+		pthread_mutex_lock(&db5_idle_lock);
+	}
+	pthread_mutex_unlock(&db5_idle_lock);
+
+	return NULL;
+}
+
+bool db5_idle_start()
+{
+	if (CONFIG_DB5_INDEX_IDLE_DELAY == 0 || db5_idle_running)
+	{
+		return true;
+	}
+
+	/* indexes are up to date when database is opened */
+	pthread_mutex_lock(&db5_write_lock);
+	db5_change_date = db5_idle_date = time(NULL);
+	pthread_mutex_unlock(&db5_write_lock);
+
+	db5_idle_running = true;
+	if (pthread_create(&db5_idle_thread, NULL, db5_idle_worker, NULL) != 0)
+	{
+		db5_idle_running = false;
+		add_log(ADDLOG_RECOVER, "[db5]idle_start", "unable to start background index writer\n");
+		return false;
+	}
+
+	return true;
+}
+
+void db5_idle_stop()
+{
+	pthread_mutex_lock(&db5_idle_lock);
+	if (!db5_idle_running)
+	{
+		pthread_mutex_unlock(&db5_idle_lock);
+		return;
+	}
+	db5_idle_running = false;
+	pthread_cond_signal(&db5_idle_stopped);
+	pthread_mutex_unlock(&db5_idle_lock);
+
+	pthread_join(db5_idle_thread, NULL);
+}
 
 bool db5_index()
 {
-	unsigned int result;
+	bool result;
 
-	result = 0;
-	db5_index_col(result, filename, DB5_IDX_CODE_FILENAME);
-	db5_index_col(result, filepath, DB5_IDX_CODE_FILEPATH);
-	db5_index_col(result, album, DB5_IDX_CODE_ALBUM);
-	db5_index_col(result, genre, DB5_IDX_CODE_GENRE);
-	db5_index_col(result, title, DB5_IDX_CODE_TITLE);
-	db5_index_col(result, artist, DB5_IDX_CODE_ARTIST);
-	db5_index_col(result, track, DB5_IDX_CODE_TRACK);
-	db5_index_col(result, source, DB5_IDX_CODE_SOURCE);
-	db5_index_col(result, reserved, DB5_IDX_CODE_DEV);
+	/* indexes must not reference deleted rows */
+	if (!db5_dat_compact())
+	{
+		add_log(ADDLOG_FAIL, "[db5]index", "unable to compact database\n");
+		return false;
+	}
+
+	/* rows must not move while they are indexed */
+	db5_dat_read_lock();
+	result = db5_index_index_all();
+	db5_dat_read_unlock();
 
-	if (result != 0x1ff)
+	if (!result)
 	{
-		add_log(ADDLOG_RECOVER, "[db5]index", "error during indexing, success bitmap=0x%p", result);
+		add_log(ADDLOG_RECOVER, "[db5]index", "error during indexing\n");
 
 		return false;
 	}
@@ -497,14 +775,17 @@ bool db5_exists(const char *filename)
 
 uint32_t db5_count()
 {
-	return db5_hdr_count();
+	return db5_dat_count();
 }
 
 void db5_print_row(db5_row *row)
 {
+	char longname[PATH_MAX];
+
 	check(row != NULL);
 
-	log_dump_latin1("(longname)", names_select_longname(row->filename));
+	names_select_longname(row->filename, longname, sizeof(longname));
+	log_dump_latin1("(longname)", longname);
 	log_dump_latin1("dir", row->filepath);
 	log_dump_latin1("file", row->filename);
 	add_log(ADDLOG_DUMP, "[db5]print_row", "bitrate: %d bit/s\n", row->bitrate);
@@ -4,13 +4,19 @@
  * @author Julien Blitte
  * @version 0.1
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -19,93 +25,881 @@
 #include "config.h"
 #include "db5_dat.h"
 #include "db5_hdr.h"
+#include "db5_index.h"
+#include "db5_journal.h"
 #include "db5_types.h"
 #include "file.h"
 #include "logger.h"
 #include "wstring.h"
 
-/** @brief Database data file */
-static FILE *db5_dat;
+/** @brief size of db5_row.filename */
+#define filename_size	(membersizeof(db5_row, filename))
+
+/** @brief Database data file, accessed without file position */
+static int db5_dat;
+
+/** @brief Lock of mapping, row count and hash table */
+static pthread_rwlock_t db5_dat_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** @brief Database data file mapping */
+static db5_row *db5_dat_map;
+
+/** @brief Decoded copy of mapping, strings are latin1 */
+static db5_row *db5_dat_decoded;
+
+/** @brief Number of rows the mapping can hold */
+static uint32_t db5_dat_capacity;
+
+/** @brief Number of rows of database */
+static uint32_t db5_dat_rows;
+
+/** @brief Number of rows in database data file, more than db5_dat_rows until write-back after a shrink */
+static uint32_t db5_dat_file_rows;
+
+/** @brief Number of rows allocated on disk, beyond end of file included */
+static uint32_t db5_dat_allocated;
+
+/** @brief Number of rows allocated at once when database file grows */
+static uint32_t db5_dat_prealloc = CONFIG_DB5_DAT_PREALLOC;
+
+/** @brief Dirty rows of mapping, one bit per row */
+static uint32_t *db5_dat_dirty;
+
+/** @brief Number of dirty rows */
+static uint32_t db5_dat_dirty_count;
+
+/** @brief Lowest dirty row */
+static uint32_t db5_dat_dirty_first;
+
+/** @brief Highest dirty row */
+static uint32_t db5_dat_dirty_last;
+
+/** @brief Deleted rows waiting for compaction, one bit per row */
+static uint32_t *db5_dat_tombstones;
+
+/** @brief Number of deleted rows waiting for compaction */
+static uint32_t db5_dat_tombstone_count;
+
+/** @brief Date of last write-back */
+static time_t db5_dat_writeback_date;
+
+/** @brief Row cache statistics */
+static db5_dat_stats db5_dat_cache;
+
+/** @brief Hash table of row positions, indexed by widechar filename */
+static uint32_t *db5_dat_hash;
+
+/** @brief Number of slots of hash table - power of two */
+static uint32_t db5_dat_hash_size;
+
+/** @brief Number of rows stored in hash table */
+static uint32_t db5_dat_hash_count;
+
+/** @brief Hash table could not be allocated, lookups scan rows until database is opened again */
+static bool db5_dat_hash_disabled;
+
+/** @brief size in bytes of a row bitmap */
+#define db5_dat_bitmap_size(rows)	((rows)/8 + sizeof(uint32_t))
+
+/** @brief test if a row is dirty */
+#define db5_dat_is_dirty(index)	(db5_dat_dirty[(index)/32] & (1U << ((index)%32)))
+
+/** @brief test if a row is deleted (waiting for compaction) */
+#define db5_dat_is_deleted(index)	(db5_dat_tombstones[(index)/32] & (1U << ((index)%32)))
+
+/**
+ * @brief refresh decoded copy of a row
+ * @param index row position
+ */
+static void db5_dat_decode(const uint32_t index)
+{
+	db5_row *row;
+
+	row = &db5_dat_decoded[index];
+	memcpy(row, &db5_dat_map[index], sizeof(db5_row));
+
+	ws_wstoa(row->filepath, membersizeof(db5_row, filepath));
+	ws_wstoa(row->filename, membersizeof(db5_row, filename));
+	ws_wstoa(row->artist,   membersizeof(db5_row, artist));
+	ws_wstoa(row->album,    membersizeof(db5_row, album));
+	ws_wstoa(row->genre,    membersizeof(db5_row, genre));
+	ws_wstoa(row->title,    membersizeof(db5_row, title));
+}
+
+/**
+ * @brief flag a row to be written back
+ * @param index row position
+ */
+static void db5_dat_set_dirty(const uint32_t index)
+{
+	db5_dat_dirty[index/32] |= 1U << (index%32);
+
+	if (db5_dat_dirty_count == 0 || index < db5_dat_dirty_first)
+	{
+		db5_dat_dirty_first = index;
+	}
+	if (db5_dat_dirty_count == 0 || index > db5_dat_dirty_last)
+	{
+		db5_dat_dirty_last = index;
+	}
+	db5_dat_dirty_count++;
+}
+
+/**
+ * @brief flag a row as modified in mapping
+ * @param index row position
+ */
+static void db5_dat_mark_dirty(const uint32_t index)
+{
+	db5_journal_row(index, &db5_dat_map[index]);
+	db5_dat_decode(index);
+
+	if (db5_dat_is_dirty(index))
+	{
+		db5_dat_cache.hits++;
+		return;
+	}
+	db5_dat_cache.misses++;
+
+	db5_dat_set_dirty(index);
+}
+
+/**
+ * @brief forget modification of a row that is no more in database
+ * @param index row position
+ */
+static void db5_dat_drop_dirty(const uint32_t index)
+{
+	if (db5_dat_is_dirty(index))
+	{
+		db5_dat_dirty[index/32] &= ~(1U << (index%32));
+		db5_dat_dirty_count--;
+	}
+}
+
+/**
+ * @brief write consecutive rows of mapping to database file
+ * @param first first row position
+ * @param count number of rows
+ * @return true if is successfull
+ */
+static bool db5_dat_write_rows(const uint32_t first, const uint32_t count)
+{
+	const char *data;
+	size_t size;
+	off_t offset;
+	ssize_t written;
+
+	data = (const char *)&db5_dat_map[first];
+	size = (size_t)count*sizeof(db5_row);
+	offset = (off_t)first*sizeof(db5_row);
+
+	while(size > 0)
+	{
+		written = pwrite(db5_dat, data, size, offset);
+		if (written <= 0)
+		{
+			add_log(ADDLOG_FAIL, "[db5/dat]writeback", "unable to write rows %u-%u into database\n", first, first+count-1);
+			return false;
+		}
+		data += written, size -= written, offset += written;
+	}
+
+	db5_dat_cache.writebacks++;
+	db5_dat_cache.rows_written += count;
+
+	return true;
+}
+
+/**
+ * @brief cut database file to row count, once rows moved by compaction are written
+ * @return true if is successfull
+ */
+static bool db5_dat_truncate()
+{
+	if (db5_dat_file_rows <= db5_dat_rows)
+	{
+		return true;
+	}
+
+	if (ftruncate(db5_dat, (off_t)db5_dat_rows*sizeof(db5_row)) != 0)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]resize", "unable to resize database file (%u rows)\n", db5_dat_rows);
+		return false;
+	}
+
+	/* blocks beyond end of file are released by truncation */
+	db5_dat_file_rows = db5_dat_rows;
+	db5_dat_allocated = db5_dat_rows;
+
+	return true;
+}
+
+/**
+ * @brief write all dirty rows to database file, in row order, neighbouring rows at once
+ * @return true if is successfull
+ */
+static bool db5_dat_writeback()
+{
+	uint32_t i, first;
+
+	/* rows of a running operation are not commited yet, they are written after it */
+	if (db5_journal_active())
+	{
+		return true;
+	}
+
+	db5_dat_writeback_date = time(NULL);
+
+	if (db5_dat_dirty_count == 0)
+	{
+		return db5_dat_truncate();
+	}
+
+	/* write-ahead: rows must be in journal before being written in place */
+	if (!db5_journal_commit())
+	{
+		return false;
+	}
+
+	add_log(ADDLOG_DEBUG, "[db5/dat]writeback", "writing %u dirty rows\n", db5_dat_dirty_count);
+
+	for(i = db5_dat_dirty_first; i <= db5_dat_dirty_last && db5_dat_dirty_count > 0; i++)
+	{
+		if (!db5_dat_is_dirty(i))
+		{
+			continue;
+		}
+
+		for(first = i; i <= db5_dat_dirty_last && db5_dat_is_dirty(i); i++)
+		{
+			db5_dat_dirty[i/32] &= ~(1U << (i%32));
+			db5_dat_dirty_count--;
+		}
+
+		if (!db5_dat_write_rows(first, i-first))
+		{
+			/* keep rows dirty to retry on next write-back */
+			for(; first < i; first++)
+			{
+				db5_dat_dirty[first/32] |= 1U << (first%32);
+				db5_dat_dirty_count++;
+			}
+			return false;
+		}
+	}
+
+	return db5_dat_truncate();
+}
+
+/**
+ * @brief write dirty rows back when they are kept in memory for too long
+ */
+static void db5_dat_writeback_timer()
+{
+	if ((db5_dat_dirty_count > 0 || db5_dat_file_rows > db5_dat_rows)
+		&& time(NULL) - db5_dat_writeback_date >= CONFIG_DB5_DAT_WRITEBACK_DELAY)
+	{
+		db5_dat_writeback();
+	}
+}
+
+/**
+ * @brief map database data file, with room for at least a number of rows
+ * @param rows number of rows the mapping must hold
+ * @return true if is successfull
+ */
+static bool db5_dat_map_rows(const uint32_t rows)
+{
+	uint32_t capacity, *dirty, *tombstones;
+	db5_row *decoded;
+	void *map;
+
+	if (db5_dat_map != NULL && rows <= db5_dat_capacity)
+	{
+		return true;
+	}
+
+	/* round up to the next chunk, so growth does not remap on every insert */
+	capacity = (rows / CONFIG_DB5_DAT_MAP_CHUNK + 1) * CONFIG_DB5_DAT_MAP_CHUNK;
+
+	dirty = (uint32_t *)realloc(db5_dat_dirty, db5_dat_bitmap_size(capacity));
+	if (dirty == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]map", "not enought memory (%u rows)\n", capacity);
+		return false;
+	}
+	if (db5_dat_map == NULL)
+	{
+		memset(dirty, 0, db5_dat_bitmap_size(capacity));
+	}
+	else
+	{
+		memset(((char *)dirty)+db5_dat_bitmap_size(db5_dat_capacity), 0,
+			db5_dat_bitmap_size(capacity)-db5_dat_bitmap_size(db5_dat_capacity));
+	}
+	db5_dat_dirty = dirty;
+
+	tombstones = (uint32_t *)realloc(db5_dat_tombstones, db5_dat_bitmap_size(capacity));
+	if (tombstones == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]map", "not enought memory (%u rows)\n", capacity);
+		return false;
+	}
+	if (db5_dat_map == NULL)
+	{
+		memset(tombstones, 0, db5_dat_bitmap_size(capacity));
+	}
+	else
+	{
+		memset(((char *)tombstones)+db5_dat_bitmap_size(db5_dat_capacity), 0,
+			db5_dat_bitmap_size(capacity)-db5_dat_bitmap_size(db5_dat_capacity));
+	}
+	db5_dat_tombstones = tombstones;
+
+	decoded = (db5_row *)realloc(db5_dat_decoded, (size_t)capacity*sizeof(db5_row));
+	if (decoded == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]map", "not enought memory (%u rows)\n", capacity);
+		return false;
+	}
+	db5_dat_decoded = decoded;
+
+	/* private mapping: modified rows only reach the file on write-back, moving keeps them */
+	if (db5_dat_map == NULL)
+	{
+		map = mmap(NULL, (size_t)capacity*sizeof(db5_row), PROT_READ | PROT_WRITE, MAP_PRIVATE, db5_dat, 0);
+	}
+	else
+	{
+		map = mremap(db5_dat_map, (size_t)db5_dat_capacity*sizeof(db5_row), (size_t)capacity*sizeof(db5_row), MREMAP_MAYMOVE);
+	}
+	if (map == MAP_FAILED)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]map", "unable to map database (%u rows)\n", capacity);
+		return false;
+	}
+
+	db5_dat_map = (db5_row *)map;
+	db5_dat_capacity = capacity;
+
+	add_log(ADDLOG_DEBUG, "[db5/dat]map", "database mapped, %u rows reserved\n", capacity);
+
+	return true;
+}
+
+/**
+ * @brief get home slot of a filename in hash table
+ * @param filename the filename to hash - widechar latin1
+ * @return slot position
+ */
+static uint32_t db5_dat_hash_home(const char *filename)
+{
+	return crc32(filename, filename_size) & (db5_dat_hash_size-1);
+}
+
+/**
+ * @brief find the slot of a row in hash table
+ * @param index row position
+ * @return slot position, DB5_ROW_NOT_FOUND if row is not in hash table
+ */
+static uint32_t db5_dat_hash_slot(const uint32_t index)
+{
+	uint32_t slot;
+
+	slot = db5_dat_hash_home(db5_dat_map[index].filename);
+	while(db5_dat_hash[slot] != DB5_ROW_NOT_FOUND)
+	{
+		if (db5_dat_hash[slot] == index)
+		{
+			return slot;
+		}
+		slot = (slot+1) & (db5_dat_hash_size-1);
+	}
+
+	return DB5_ROW_NOT_FOUND;
+}
+
+/**
+ * @brief add a row in hash table, table must not be full
+ * @param index row position
+ */
+static void db5_dat_hash_add(const uint32_t index)
+{
+	uint32_t slot;
+
+	slot = db5_dat_hash_home(db5_dat_map[index].filename);
+	while(db5_dat_hash[slot] != DB5_ROW_NOT_FOUND)
+	{
+		slot = (slot+1) & (db5_dat_hash_size-1);
+	}
+
+	db5_dat_hash[slot] = index;
+}
+
+/**
+ * @brief build hash table for the first rows of database
+ * @param count number of rows to store
+ * @return true if is successfull
+ */
+static bool db5_dat_hash_build(const uint32_t count)
+{
+	uint32_t size, i;
+
+	/* keep load factor under one half */
+	for(size = 64; size < 2*(uint64_t)count+2; size <<= 1);
+
+	free(db5_dat_hash);
+	db5_dat_hash_count = 0;
+
+	db5_dat_hash = (uint32_t *)malloc(size*sizeof(uint32_t));
+	if (db5_dat_hash == NULL)
+	{
+		add_log(ADDLOG_RECOVER, "[db5/dat]hash", "not enought memory (%u entries), lookups will be slow\n", count);
+		db5_dat_hash_disabled = true;
+		return false;
+	}
+	memset(db5_dat_hash, 0xff, size*sizeof(uint32_t));
+	db5_dat_hash_size = size;
+
+	for(i=0; i < count; i++)
+	{
+		if (!db5_dat_is_deleted(i))
+		{
+			db5_dat_hash_add(i);
+		}
+	}
+	db5_dat_hash_count = count;
+
+	add_log(ADDLOG_DEBUG, "[db5/dat]hash", "%u rows hashed into %u slots\n", count, size);
+
+	return true;
+}
+
+/**
+ * @brief add last row in hash table
+ * @param index row position, must be db5_dat_hash_count
+ */
+static void db5_dat_hash_append(const uint32_t index)
+{
+	check(index == db5_dat_hash_count);
+
+	if (db5_dat_hash == NULL)
+	{
+		return;
+	}
+
+	if (2*(uint64_t)(db5_dat_hash_count+1) >= db5_dat_hash_size)
+	{
+		db5_dat_hash_build(db5_dat_hash_count+1);
+		return;
+	}
+
+	db5_dat_hash_add(index);
+	db5_dat_hash_count++;
+}
+
+/**
+ * @brief remove a row from hash table (linear probing backward shift)
+ * @param index row position
+ * @return true if row was in hash table
+ */
+static bool db5_dat_hash_remove(const uint32_t index)
+{
+	uint32_t slot, next, home;
+
+	if (db5_dat_hash == NULL)
+	{
+		return false;
+	}
+
+	slot = db5_dat_hash_slot(index);
+	if (slot == DB5_ROW_NOT_FOUND)
+	{
+		return false;
+	}
+
+	/* move back entries of the same cluster that would be unreachable */
+	next = (slot+1) & (db5_dat_hash_size-1);
+	while(db5_dat_hash[next] != DB5_ROW_NOT_FOUND)
+	{
+		home = db5_dat_hash_home(db5_dat_map[db5_dat_hash[next]].filename);
+		if (((next - home) & (db5_dat_hash_size-1)) >= ((next - slot) & (db5_dat_hash_size-1)))
+		{
+			db5_dat_hash[slot] = db5_dat_hash[next];
+			slot = next;
+		}
+		next = (next+1) & (db5_dat_hash_size-1);
+	}
+	db5_dat_hash[slot] = DB5_ROW_NOT_FOUND;
+
+	return true;
+}
+
+/**
+ * @brief allocate disk space of database data file by chunks, file size is unchanged
+ * @param rows number of rows that must be allocated
+ */
+static void db5_dat_preallocate(const uint32_t rows)
+{
+	uint32_t allocated;
+
+	if (db5_dat_prealloc == 0 || rows <= db5_dat_allocated)
+	{
+		return;
+	}
+
+	/* round up to the next chunk, so the file grows in large contiguous extents */
+	allocated = (rows / db5_dat_prealloc + 1) * db5_dat_prealloc;
+
+	if (fallocate(db5_dat, FALLOC_FL_KEEP_SIZE, (off_t)db5_dat_allocated*sizeof(db5_row),
+		(off_t)(allocated-db5_dat_allocated)*sizeof(db5_row)) != 0)
+	{
+		if (errno == EOPNOTSUPP || errno == ENOSYS)
+		{
+			add_log(ADDLOG_NOTICE, "[db5/dat]preallocate", "not supported by filesystem, disabled\n");
+			db5_dat_prealloc = 0;
+		}
+		else
+		{
+			add_log(ADDLOG_RECOVER, "[db5/dat]preallocate", "unable to allocate %u rows: %s\n", allocated, strerror(errno));
+		}
+		return;
+	}
+
+	add_log(ADDLOG_DEBUG, "[db5/dat]preallocate", "%u rows allocated\n", allocated);
+
+	db5_dat_allocated = allocated;
+}
+
+/**
+ * @brief resize database data file
+ * @param rows new number of rows
+ * @return true if is successfull
+ */
+static bool db5_dat_resize(const uint32_t rows)
+{
+	uint32_t i;
+
+	if (!db5_dat_map_rows(rows))
+	{
+		return false;
+	}
+
+	/* file is shrunk by write-back, after rows moved by compaction */
+	if (rows > db5_dat_file_rows)
+	{
+		db5_dat_preallocate(rows);
+
+		if (ftruncate(db5_dat, (off_t)rows*sizeof(db5_row)) != 0)
+		{
+			add_log(ADDLOG_FAIL, "[db5/dat]resize", "unable to resize database file (%u rows)\n", rows);
+			return false;
+		}
+	}
+
+	/*
+	 * new rows are blanked in mapping: a page copied before file was shrunk
+	 * keeps its old rows once file grows again. rows still in file are
+	 * blanked on write-back.
+	 */
+	for(i = db5_dat_rows; i < rows; i++)
+	{
+		memset(&db5_dat_map[i], 0, sizeof(db5_row));
+		if (i < db5_dat_file_rows)
+		{
+			db5_dat_set_dirty(i);
+		}
+		db5_dat_decode(i);
+	}
+
+	if (rows > db5_dat_file_rows)
+	{
+		db5_dat_file_rows = rows;
+	}
+
+	db5_dat_rows = rows;
+
+	return true;
+}
+
+static bool db5_dat_compact_rows();
+
+bool db5_dat_init()
+{
+	uint32_t i;
+
+	crc32_init();
+
+	db5_dat = file_caseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_DAT_FILE, O_RDWR);
+
+	if (db5_dat == -1)
+	{
+		add_log(ADDLOG_CRITICAL, "[db5/dat]init", "unable to init database\n");
+		return false;
+	}
+
+	db5_dat_map = NULL;
+	db5_dat_decoded = NULL;
+	db5_dat_dirty = NULL;
+	db5_dat_dirty_count = 0;
+	db5_dat_tombstones = NULL;
+	db5_dat_tombstone_count = 0;
+	db5_dat_writeback_date = time(NULL);
+	memset(&db5_dat_cache, 0, sizeof(db5_dat_cache));
+	db5_dat_rows = file_filesize_d(db5_dat) / sizeof(db5_row);
+	db5_dat_file_rows = db5_dat_rows;
+	db5_dat_allocated = db5_dat_rows;
+
+	if (!db5_dat_map_rows(db5_dat_rows))
+	{
+		add_log(ADDLOG_CRITICAL, "[db5/dat]init", "unable to map database\n");
+		close(db5_dat);
+		return false;
+	}
+
+	/* rows are decoded once, then on each modification */
+	for(i=0; i < db5_dat_rows; i++)
+	{
+		db5_dat_decode(i);
+	}
+
+	db5_dat_hash = NULL;
+	db5_dat_hash_disabled = false;
+	db5_dat_hash_build(db5_hdr_count() < db5_dat_rows ? db5_hdr_count() : db5_dat_rows);
+
+	return true;
+}
+
+void db5_dat_free()
+{
+	db5_dat_sync();
+
+	add_log(ADDLOG_NOTICE, "[db5/dat]free", "row cache: %u hits, %u misses, %u writes for %u rows\n",
+		db5_dat_cache.hits, db5_dat_cache.misses, db5_dat_cache.writebacks, db5_dat_cache.rows_written);
+
+	free(db5_dat_hash);
+	db5_dat_hash = NULL;
+	free(db5_dat_dirty);
+	db5_dat_dirty = NULL;
+	free(db5_dat_tombstones);
+	db5_dat_tombstones = NULL;
+	free(db5_dat_decoded);
+	db5_dat_decoded = NULL;
+
+	munmap(db5_dat_map, (size_t)db5_dat_capacity*sizeof(db5_row));
+	db5_dat_map = NULL;
+
+	close(db5_dat);
+}
+
+bool db5_dat_sync()
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+
+	result = db5_dat_compact_rows() && db5_dat_writeback();
+
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	if (result && fdatasync(db5_dat) != 0)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]sync", "unable to write database to disk\n");
+		return false;
+	}
+
+	return result;
+}
+
+void db5_dat_timer()
+{
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	db5_dat_writeback_timer();
+	pthread_rwlock_unlock(&db5_dat_lock);
+}
+
+void db5_dat_set_prealloc(const uint32_t rows)
+{
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	db5_dat_prealloc = rows;
+	pthread_rwlock_unlock(&db5_dat_lock);
+}
+
+void db5_dat_read_lock()
+{
+	pthread_rwlock_rdlock(&db5_dat_lock);
+}
+
+void db5_dat_read_unlock()
+{
+	pthread_rwlock_unlock(&db5_dat_lock);
+}
 
-bool db5_dat_init()
+void db5_dat_cache_stats(db5_dat_stats *stats)
 {
-	crc32_init();
+	check(stats != NULL);
 
-	db5_dat = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_DAT_FILE, "rb+");
+	pthread_rwlock_rdlock(&db5_dat_lock);
+	memcpy(stats, &db5_dat_cache, sizeof(db5_dat_stats));
+	pthread_rwlock_unlock(&db5_dat_lock);
+}
 
-	if (db5_dat == NULL)
+const db5_row *db5_dat_row(const uint32_t index)
+{
+	if (index >= db5_dat_rows)
 	{
-		add_log(ADDLOG_CRITICAL, "[db5/dat]init", "unable to init database\n");
-		return false;
+		return NULL;
 	}
-	
-	return true;
+
+	return &db5_dat_map[index];
 }
 
-void db5_dat_free()
+const db5_row *db5_dat_decoded_row(const uint32_t index)
 {
-	fclose(db5_dat);
+	if (index >= db5_dat_rows)
+	{
+		return NULL;
+	}
+
+	return &db5_dat_decoded[index];
 }
 
-bool db5_dat_select_row(const uint32_t index, db5_row *row)
+bool db5_dat_select_decoded(const uint32_t index, db5_row *row)
 {
 	check(row != NULL);
 
-	if (fseek(db5_dat, index*sizeof(db5_row), SEEK_SET) != 0)
+	pthread_rwlock_rdlock(&db5_dat_lock);
+
+	if (index >= db5_dat_rows)
 	{
+		pthread_rwlock_unlock(&db5_dat_lock);
 		add_log(ADDLOG_FAIL, "[db5/dat]read", "unable to find database row (reading)\n");
 		return false;
 	}
-	if (fread(row, sizeof(db5_row), 1, db5_dat) != 1)
+
+	memcpy(row, &db5_dat_decoded[index], sizeof(db5_row));
+
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return true;
+}
+
+bool db5_dat_select_row(const uint32_t index, db5_row *row)
+{
+	check(row != NULL);
+
+	pthread_rwlock_rdlock(&db5_dat_lock);
+
+	if (index >= db5_dat_rows)
 	{
-		add_log(ADDLOG_FAIL, "[db5/dat]read", "unable to read into database\n");
+		pthread_rwlock_unlock(&db5_dat_lock);
+		add_log(ADDLOG_FAIL, "[db5/dat]read", "unable to find database row (reading)\n");
 		return false;
 	}
 
+	memcpy(row, &db5_dat_map[index], sizeof(db5_row));
+
+	pthread_rwlock_unlock(&db5_dat_lock);
+
 	return true;
 }
 
-bool db5_dat_update(const uint32_t index, db5_row *row)
+/**
+ * @brief modify a row, database lock must be held for writing
+ * @param index row position
+ * @param row new row
+ * @return true if is successfull
+ */
+static bool db5_dat_replace(const uint32_t index, const db5_row *row)
 {
 	check(row != NULL);
 
-	if (fseek(db5_dat, index*sizeof(db5_row), SEEK_SET) != 0)
+	if (index >= db5_dat_rows)
 	{
 		add_log(ADDLOG_FAIL, "[db5/dat]alter", "unable to find database row (writing)\n");
 		return false;
 	}
-	if (fwrite(row, sizeof(db5_row), 1, db5_dat) != 1)
+
+	/* nothing to write back */
+	if (memcmp(&db5_dat_map[index], row, sizeof(db5_row)) == 0)
+	{
+		db5_dat_cache.hits++;
+		return true;
+	}
+
+	/* row is indexed again with its new keys */
+	if (index < db5_hdr_count() && !db5_dat_is_deleted(index))
 	{
-		add_log(ADDLOG_FAIL, "[db5/dat]alter", "unable to write into database\n");
-		return false;
+		db5_index_update_row(index, row);
+	}
+
+	/* filename is the hash key: re-hash row */
+	if (memcmp(db5_dat_map[index].filename, row->filename, filename_size) != 0 && db5_dat_hash_remove(index))
+	{
+		memcpy(&db5_dat_map[index], row, sizeof(db5_row));
+		db5_dat_hash_add(index);
+	}
+	else
+	{
+		memcpy(&db5_dat_map[index], row, sizeof(db5_row));
 	}
 
+	db5_dat_mark_dirty(index);
+	db5_dat_writeback_timer();
+
 	return true;
 }
 
-bool db5_dat_insert(db5_row *row)
+/**
+ * @brief add rows at end of database, database lock must be held for writing
+ * @param rows new rows
+ * @param number number of rows
+ * @return true if is successfull
+ */
+static bool db5_dat_append(const db5_row *rows, const uint32_t number)
 {
-	check(row != NULL);
+	uint32_t count, i;
+
+	if (number == 0)
+	{
+		return true;
+	}
+
+	check(rows != NULL);
+
+	count = db5_hdr_count();
 
-	if (db5_hdr_count() >= CONFIG_MAX_DB5_ENTRY)
+	if (count >= CONFIG_MAX_DB5_ENTRY || number > CONFIG_MAX_DB5_ENTRY - count)
 	{
 		add_log(ADDLOG_FAIL, "[db5/dat]add", "database if full\n");
 		return false;
 	}
 
-	if (fseek(db5_dat, db5_hdr_count()*sizeof(db5_row), SEEK_SET) != 0)
+	if (count+number > db5_dat_rows && !db5_dat_resize(count+number))
 	{
 		add_log(ADDLOG_FAIL, "[db5/dat]add", "unable to add database row\n");
 		return false;
 	}
-	if (fwrite(row, sizeof(db5_row), 1, db5_dat) != 1)
+
+	/* rows are contiguous, they will be written back at once */
+	memcpy(&db5_dat_map[count], rows, (size_t)number*sizeof(db5_row));
+
+	for(i = count; i < count+number; i++)
 	{
-		add_log(ADDLOG_FAIL, "[db5/dat]add", "unable to write into database\n");
-		return false;
+		db5_dat_mark_dirty(i);
+		db5_index_insert_row(i);
+
+		if (db5_dat_hash_count == i)
+		{
+			db5_dat_hash_append(i);
+		}
 	}
 
-	/* update meta-database */
-	if (db5_hdr_grow(1) != true)
+	db5_dat_writeback_timer();
+
+	/* update meta-database once for all rows */
+	if (db5_hdr_grow((int)number) != true)
 	{
 		add_log(ADDLOG_FAIL, "[db5/dat]add", "unable to update meta-database\n");
 		return false;
@@ -114,73 +908,390 @@ bool db5_dat_insert(db5_row *row)
 	return true;
 }
 
-bool db5_dat_delete_row(const uint32_t index)
+/**
+ * @brief hide a row until next compaction, database lock must be held for writing
+ * @param index row position
+ * @return true if is successfull
+ */
+static bool db5_dat_hide(const uint32_t index)
 {
-	db5_row row;
 	uint32_t count;
 
 	count = db5_hdr_count();
 
-	if (index < 0 || index >= count)
+	if (index >= count || index >= db5_dat_rows)
 	{
 		add_log(ADDLOG_FAIL, "[db5/dat]delete", "index out of databse (%u)\n", index);
 		return false;
 	}
 
-	if (index != count-1)
+	if (db5_dat_is_deleted(index))
 	{
-		if (db5_dat_select_row(count-1, &row) == false)
+		add_log(ADDLOG_FAIL, "[db5/dat]delete", "row %u is already deleted\n", index);
+		return false;
+	}
+
+	db5_journal_delete(index);
+
+	/* row is hidden now, and removed from file on next compaction */
+	db5_dat_hash_remove(index);
+	db5_index_remove_row(index);
+	db5_dat_tombstones[index/32] |= 1U << (index%32);
+	db5_dat_tombstone_count++;
+
+	if (db5_dat_tombstone_count > CONFIG_DB5_DAT_TOMBSTONES)
+	{
+		return db5_dat_compact_rows();
+	}
+
+	return true;
+}
+
+/**
+ * @brief remove deleted rows from database file, database lock must be held for writing
+ * @return true if is successfull
+ */
+static bool db5_dat_compact_rows()
+{
+	uint32_t count, live, last, i;
+
+	if (db5_dat_tombstone_count == 0)
+	{
+		return true;
+	}
+
+	/* never read beyond rows of database file */
+	count = db5_hdr_count();
+	if (count > db5_dat_rows)
+	{
+		count = db5_dat_rows;
+	}
+	live = count - db5_dat_tombstone_count;
+
+	add_log(ADDLOG_DEBUG, "[db5/dat]compact", "removing %u deleted rows\n", db5_dat_tombstone_count);
+
+	/* fill holes with the last live rows */
+	last = count;
+	for(i=0; i < live; i++)
+	{
+		if (!db5_dat_is_deleted(i))
 		{
-			return false;
+			continue;
 		}
 
-		if (db5_dat_update (index, &row) == false)
+		do
 		{
-			return false;
+			last--;
+		}
+		while(db5_dat_is_deleted(last));
+
+		db5_index_remove_row(last);
+		if (db5_dat_hash_remove(last))
+		{
+			memcpy(&db5_dat_map[i], &db5_dat_map[last], sizeof(db5_row));
+			db5_dat_hash_add(i);
+		}
+		else
+		{
+			memcpy(&db5_dat_map[i], &db5_dat_map[last], sizeof(db5_row));
 		}
+		db5_index_insert_row(i);
+		db5_dat_mark_dirty(i);
+	}
+
+	for(i = live; i < count; i++)
+	{
+		db5_dat_drop_dirty(i);
+	}
+	memset(db5_dat_tombstones, 0, db5_dat_bitmap_size(count));
+	db5_dat_tombstone_count = 0;
+
+	if (db5_dat_hash_count == count)
+	{
+		db5_dat_hash_count = live;
 	}
 
 	/* update meta-database */
-	if (db5_hdr_grow(-1) != true)
+	if (db5_hdr_grow((int)(live - db5_hdr_count())) != true)
 	{
-		add_log(ADDLOG_FAIL, "[db5/dat]delete", "unable to update meta-database\n");
+		add_log(ADDLOG_FAIL, "[db5/dat]compact", "unable to update meta-database\n");
 		return false;
 	}
 
 	/* resize database file */
-	if (!file_truncate(db5_dat, count*sizeof(db5_row)))
+	if (!db5_dat_resize(live))
 	{
-		add_log(ADDLOG_FAIL, "[db5/dat]delete", "unable to resize database file\n");
+		add_log(ADDLOG_FAIL, "[db5/dat]compact", "unable to resize database file\n");
 		return false;
 	}
 
+	db5_dat_writeback_timer();
+
 	return true;
 }
 
-/** @brief size of db5_row.filename */
-#define filename_size	(membersizeof(db5_row, filename))
+/**
+ * @brief write a row at a given position, database lock must be held for writing
+ * @param index row position
+ * @param row row to write
+ * @return true if is successfull
+ */
+static bool db5_dat_restore(const uint32_t index, const db5_row *row)
+{
+	check(row != NULL);
 
-uint32_t db5_dat_select_by_filename(const char *filename)
+	if (index >= CONFIG_MAX_DB5_ENTRY)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]restore", "index out of databse (%u)\n", index);
+		return false;
+	}
+
+	if (index >= db5_dat_rows && !db5_dat_resize(index+1))
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]restore", "unable to add database row\n");
+		return false;
+	}
+
+	memcpy(&db5_dat_map[index], row, sizeof(db5_row));
+	db5_dat_mark_dirty(index);
+
+	/* a row image replaces a deleted row filled by compaction */
+	if (db5_dat_is_deleted(index))
+	{
+		db5_dat_tombstones[index/32] &= ~(1U << (index%32));
+		db5_dat_tombstone_count--;
+	}
+
+	/* hash table is rebuilt on next lookup, indexes on next indexing */
+	db5_dat_hash_count = DB5_ROW_NOT_FOUND;
+	db5_index_invalidate();
+
+	return true;
+}
+
+/**
+ * @brief hide a row without compaction, database lock must be held for writing
+ * @param index row position
+ * @return true if is successfull
+ */
+static bool db5_dat_restore_hidden(const uint32_t index)
 {
-	char shortname [filename_size];
-	uint32_t count, i;
-	db5_row row;
+	/* already replayed, or beyond rows of database file */
+	if (index >= db5_hdr_count() || index >= db5_dat_rows || db5_dat_is_deleted(index))
+	{
+		return true;
+	}
 
-	check(filename != NULL);
+	db5_dat_tombstones[index/32] |= 1U << (index%32);
+	db5_dat_tombstone_count++;
 
-	strncpy(shortname, filename, filename_size/2);
-	ws_atows(shortname, filename_size);
+	/* hash table is rebuilt on next lookup, indexes on next indexing */
+	db5_dat_hash_count = DB5_ROW_NOT_FOUND;
+	db5_index_invalidate();
+
+	return true;
+}
+
+/**
+ * @brief set number of rows, database lock must be held for writing
+ * @param count number of rows
+ * @return true if is successfull
+ */
+static bool db5_dat_restore_rows(const uint32_t count)
+{
+	uint32_t i;
+
+	if (count > CONFIG_MAX_DB5_ENTRY)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]restore", "count out of databse (%u)\n", count);
+		return false;
+	}
+
+	/* rows beyond count were never commited */
+	for(i = count; i < db5_dat_rows; i++)
+	{
+		if (db5_dat_is_deleted(i))
+		{
+			db5_dat_tombstones[i/32] &= ~(1U << (i%32));
+			db5_dat_tombstone_count--;
+		}
+		db5_dat_drop_dirty(i);
+	}
+
+	if (db5_hdr_grow((int)(count - db5_hdr_count())) != true)
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]restore", "unable to update meta-database\n");
+		return false;
+	}
+
+	if (count != db5_dat_rows && !db5_dat_resize(count))
+	{
+		add_log(ADDLOG_FAIL, "[db5/dat]restore", "unable to resize database file\n");
+		return false;
+	}
+
+	/* hash table is rebuilt on next lookup, indexes on next indexing */
+	db5_dat_hash_count = DB5_ROW_NOT_FOUND;
+	db5_index_invalidate();
+
+	return true;
+}
+
+bool db5_dat_update(const uint32_t index, db5_row *row)
+{
+	bool result;
+
+	check(row != NULL);
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_replace(index, row);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+bool db5_dat_insert(db5_row *row)
+{
+	bool result;
+
+	check(row != NULL);
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_append(row, 1);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+bool db5_dat_insert_many(db5_row *rows, const uint32_t number)
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_append(rows, number);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	/* end of batch */
+	return result && db5_hdr_flush();
+}
+
+bool db5_dat_delete_row(const uint32_t index)
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_hide(index);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+bool db5_dat_compact()
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_compact_rows();
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+bool db5_dat_restore_row(const uint32_t index, const db5_row *row)
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_restore(index, row);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+bool db5_dat_restore_delete(const uint32_t index)
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_restore_hidden(index);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+bool db5_dat_restore_count(const uint32_t count)
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&db5_dat_lock);
+	result = db5_dat_restore_rows(count);
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
+
+uint32_t db5_dat_count()
+{
+	uint32_t count;
+
+	pthread_rwlock_rdlock(&db5_dat_lock);
+	count = db5_hdr_count() - db5_dat_tombstone_count;
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return count;
+}
+
+bool db5_dat_deleted(const uint32_t index)
+{
+	return (index < db5_dat_rows && db5_dat_is_deleted(index));
+}
+
+/**
+ * @brief get number of rows that can be looked up, database lock must be held
+ * @return number of rows
+ */
+static uint32_t db5_dat_lookup_count()
+{
+	uint32_t count;
 
 	count = db5_hdr_count();
-	for(i=0; i < count; i++)
+	if (count > db5_dat_rows)
 	{
-		if(!db5_dat_select_row(i, &row))
+		add_log(ADDLOG_FAIL, "[db5/dat]select_by_filename", "error reading database\n");
+		count = db5_dat_rows;
+	}
+
+	return count;
+}
+
+/**
+ * @brief find a row by its filename, database lock must be held
+ * @param shortname the filename - widechar latin1
+ * @param count number of rows
+ * @return row position, (unsigned)-1 if no found
+ */
+static uint32_t db5_dat_lookup(const char *shortname, const uint32_t count)
+{
+	uint32_t i, found;
+
+	if (db5_dat_hash != NULL)
+	{
+		/* same row as a scan: the first one, if filename is duplicated */
+		found = DB5_ROW_NOT_FOUND;
+		for(i = db5_dat_hash_home(shortname); db5_dat_hash[i] != DB5_ROW_NOT_FOUND; i = (i+1) & (db5_dat_hash_size-1))
 		{
-			add_log(ADDLOG_FAIL, "[db5/dat]select_by_filename", "error reading database\n");
-			return DB5_ROW_NOT_FOUND;
+			if (db5_dat_hash[i] < found && memcmp(db5_dat_map[db5_dat_hash[i]].filename, shortname, filename_size) == 0)
+			{
+				found = db5_dat_hash[i];
+			}
 		}
 
-		if (memcmp(row.filename, shortname, filename_size) == 0)
+		return found;
+	}
+
+	for(i=0; i < count; i++)
+	{
+		if (!db5_dat_is_deleted(i) && memcmp(db5_dat_map[i].filename, shortname, filename_size) == 0)
 		{
 			return i;
 		}
@@ -189,3 +1300,35 @@ uint32_t db5_dat_select_by_filename(const char *filename)
 	return DB5_ROW_NOT_FOUND;
 }
 
+uint32_t db5_dat_select_by_filename(const char *filename)
+{
+	char shortname [filename_size];
+	uint32_t count, result;
+
+	check(filename != NULL);
+
+	strncpy(shortname, filename, filename_size/2);
+	ws_atows(shortname, filename_size);
+
+	pthread_rwlock_rdlock(&db5_dat_lock);
+	count = db5_dat_lookup_count();
+
+	/* row count was changed outside of db5_dat (fsck): hash table is rebuilt, which needs a write lock */
+	if (!db5_dat_hash_disabled && db5_dat_hash_count != count)
+	{
+		pthread_rwlock_unlock(&db5_dat_lock);
+		pthread_rwlock_wrlock(&db5_dat_lock);
+
+		count = db5_dat_lookup_count();
+		if (!db5_dat_hash_disabled && db5_dat_hash_count != count)
+		{
+			db5_dat_hash_build(count);
+		}
+	}
+
+	result = db5_dat_lookup(shortname, count);
+
+	pthread_rwlock_unlock(&db5_dat_lock);
+
+	return result;
+}
@@ -4,57 +4,107 @@
  * @author Julien Blitte
  * @version 0.1
  */
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "check.h"
+#include "config.h"
 #include "db5_hdr.h"
+#include "db5_journal.h"
 #include "db5_types.h"
 #include "file.h"
 #include "logger.h"
 
-/** @brief Offset in database meta-data file */
-#define DB5_HDR_COUNT_OFFSET	1040
-
-/** @brief Database meta-data file */
-static FILE *db5_hdr;
+/** @brief Database meta-data file, accessed without file position */
+static int db5_hdr;
 
 /** @brief Current number entries */
 static uint32_t count;
 
-bool db5_hdr_init()
+/** @brief Count was modified since last write */
+static bool db5_hdr_dirty;
+
+/** @brief Date of last write */
+static time_t db5_hdr_date;
+
+/** @brief Lock of count and its dirty flag */
+static pthread_mutex_t db5_hdr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief write count to meta-database file if modified, lock must be held
+ * @return true if successfull
+ */
+static bool db5_hdr_write()
 {
-	db5_hdr = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_HDR_FILE, "rb+");
+	/* count of a running operation is not commited yet, it is written after it */
+	if (db5_journal_active())
+	{
+		return true;
+	}
 
-	if (db5_hdr == NULL)
+	db5_hdr_date = time(NULL);
+
+	if (!db5_hdr_dirty)
+	{
+		return true;
+	}
+
+	/* write-ahead: count must be in journal before being written in place */
+	if (!db5_journal_commit())
 	{
-		add_log(ADDLOG_CRITICAL, "[db5/hdr]init", "unable to init database\n");
 		return false;
 	}
 
-	if (fseek(db5_hdr, DB5_HDR_COUNT_OFFSET, SEEK_SET) != 0)
+	if (pwrite(db5_hdr, &count, sizeof(count), DB5_HDR_COUNT_OFFSET) != sizeof(count))
 	{
-		add_log(ADDLOG_CRITICAL, "[db5/hdr]init", "unable to find count value\n");
+		add_log(ADDLOG_FAIL, "[db5/hdr]write", "unable to write count value\n");
 		return false;
 	}
-	if (fread(&count, sizeof(count), 1, db5_hdr) != 1)
+
+	db5_hdr_dirty = false;
+
+	return true;
+}
+
+bool db5_hdr_init()
+{
+	db5_hdr = file_caseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_HDR_FILE, O_RDWR);
+
+	if (db5_hdr == -1)
+	{
+		add_log(ADDLOG_CRITICAL, "[db5/hdr]init", "unable to init database\n");
+		return false;
+	}
+
+	if (pread(db5_hdr, &count, sizeof(count), DB5_HDR_COUNT_OFFSET) != sizeof(count))
 	{
 		add_log(ADDLOG_CRITICAL, "[db5/hdr]init", "unable to read count value\n");
+		close(db5_hdr);
 		return false;
 	}
 
+	db5_hdr_dirty = false;
+	db5_hdr_date = time(NULL);
+
 	return true;
 }
 
 bool db5_hdr_free()
 {
-	fclose(db5_hdr);
+	bool result;
 
-	return true;
+	result = db5_hdr_flush();
+	close(db5_hdr);
+
+	return result;
 }
 
 uint32_t db5_hdr_count()
@@ -66,26 +116,58 @@ uint32_t db5_hdr_count()
 	return count;
 }
 
-bool db5_hdr_grow(const int delta)
+bool db5_hdr_flush()
 {
-	count += delta;
+	bool result;
+
+	pthread_mutex_lock(&db5_hdr_lock);
+	result = db5_hdr_write();
+	pthread_mutex_unlock(&db5_hdr_lock);
+
+	return result;
+}
 
-	if (fseek(db5_hdr, DB5_HDR_COUNT_OFFSET, SEEK_SET) != 0)
+bool db5_hdr_sync()
+{
+	if (!db5_hdr_flush() || fdatasync(db5_hdr) != 0)
 	{
-		add_log(ADDLOG_FAIL, "[db5/hdr]add", "unable to find count value\n");
+		add_log(ADDLOG_FAIL, "[db5/hdr]sync", "unable to write meta-database to disk\n");
 		return false;
 	}
-	if (fwrite(&count, sizeof(count), 1, db5_hdr) != 1)
+
+	return true;
+}
+
+void db5_hdr_timer()
+{
+	pthread_mutex_lock(&db5_hdr_lock);
+	if (db5_hdr_dirty && (CONFIG_DB5_HDR_STRICT || time(NULL) - db5_hdr_date >= CONFIG_DB5_HDR_WRITE_DELAY))
 	{
-		add_log(ADDLOG_FAIL, "[db5/hdr]add", "unable to write count value\n");
-		return false;
+		db5_hdr_write();
 	}
-	if (fflush(db5_hdr) != 0)
+	pthread_mutex_unlock(&db5_hdr_lock);
+}
+
+bool db5_hdr_grow(const int delta)
+{
+	bool result;
+
+	pthread_mutex_lock(&db5_hdr_lock);
+
+	count += delta;
+	db5_hdr_dirty = true;
+
+	db5_journal_count(count);
+
+	/* count is written on sync, or when it is kept in memory for too long */
+	result = true;
+	if (CONFIG_DB5_HDR_STRICT || time(NULL) - db5_hdr_date >= CONFIG_DB5_HDR_WRITE_DELAY)
 	{
-		add_log(ADDLOG_FAIL, "[db5/hdr]add", "unable to write count value (flush)\n");
-		return false;
+		result = db5_hdr_write();
 	}
 
-	return true;
+	pthread_mutex_unlock(&db5_hdr_lock);
+
+	return result;
 }
 
@@ -4,15 +4,22 @@
  * @author Julien Blitte
  * @version 0.1
  */
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "check.h"
+#include "config.h"
 #include  "db5_dat.h"
 #include  "db5_hdr.h"
 #include  "db5_index.h"
@@ -20,11 +27,15 @@
 #include  "file.h"
 #include  "crc32.h"
 #include "logger.h"
+#include "wstring.h"
 
 
 /** @brief get n-th byte of an object */
 #define byteof(c,i) (((char *)&c)[(i)])
 
+/** @brief number of entries under which radix sort ends with insertion sort */
+#define radix_cutoff	32
+
 
 /** @brief index entry */
 typedef struct
@@ -38,31 +49,99 @@ typedef struct
 } index_entry;
 
 
-/** @brief data used to generate index */
-static char *index_master_data;
+/** @brief fingerprint of an index file, stored in fingerprints file */
+typedef struct
+{
+	/** @brief index code, 0 if fingerprint is unknown */
+	uint32_t code;
+	/** @brief number of entries of index file */
+	uint32_t count;
+	/** @brief crc32 of entries of index file */
+	uint32_t crc;
+	/** @brief modification date of index file when it was written */
+	uint32_t date;
+} index_fingerprint;
+
+
+/** @brief indexed column */
+typedef struct
+{
+	/** @brief index code */
+	uint32_t code;
+	/** @brief position of column in a row */
+	ptrdiff_t offset;
+	/** @brief size of column */
+	size_t size;
+	/** @brief if column is a pseudo-unicode string */
+	bool wide;
+} db5_index_column;
+
+
+/** @brief data used to generate index of a column */
+typedef struct
+{
+	/** @brief keys of column, one per row */
+	const char *data;
+	/** @brief size of a key */
+	size_t size;
+} index_keys;
 
-/** @brief size of data to index */
-static uint32_t index_entry_size;
+/** @brief work shared by index generation threads */
+typedef struct
+{
+	/** @brief columns to index */
+	const db5_index_column *columns;
+	/** @brief keys of columns */
+	char **data;
+	/** @brief hidden flag of rows */
+	const uint32_t *hidden;
+	/** @brief positions of rows to index, deleted rows excluded */
+	const uint32_t *positions;
+	/** @brief number of rows to index */
+	uint32_t count;
+	/** @brief sorted entries of columns, kept if not NULL */
+	index_entry **tables;
+	/** @brief if index files are written */
+	bool write;
+	/** @brief number of columns */
+	unsigned int number;
+	/** @brief next column to index */
+	unsigned int next;
+	/** @brief false if a column failed */
+	bool result;
+	/** @brief lock of next and result */
+	pthread_mutex_t lock;
+} index_pool;
 
 
 
 /**
- * @brief compare two index entries using index_master_data
+ * @brief compare two index entries using keys of column, equal keys are ordered by position
  * @param entry1 first entry
  * @param entry2 second entry
+ * @param keys keys of column
  * @return postive if entry1 > entry2, negative else
  */
-static int db5_index_compare_entries(const void *entry1, const void *entry2)
+static int db5_index_compare_entries(const void *entry1, const void *entry2, void *keys)
 {
 	uint32_t pos1, pos2;
+	const index_keys *k;
+	int result;
 
 	check(entry1 != NULL);
 	check(entry2 != NULL);
 
+	k = (const index_keys *)keys;
 	pos1 = ((index_entry *)entry1)->position;
 	pos2 = ((index_entry *)entry2)->position;
 
-	return memcmp(index_master_data+pos1*index_entry_size, index_master_data+pos2*index_entry_size, index_entry_size);
+	result = memcmp(k->data+pos1*k->size, k->data+pos2*k->size, k->size);
+	if (result == 0)
+	{
+		result = (pos1 > pos2) - (pos1 < pos2);
+	}
+
+	return result;
 }
 
 /**
@@ -81,110 +160,2008 @@ static void index_dump_table(const index_entry *entries, const uint32_t count)
 }
 
 
-bool db5_index_index_column(const ptrdiff_t reloffset, const size_t size, const uint32_t code)
+/** @brief columns of database that are indexed, in generation order */
+static const db5_index_column db5_index_columns[] =
+{
+	{ DB5_IDX_CODE_FILENAME, offsetof(db5_row, filename), membersizeof(db5_row, filename), true },
+	{ DB5_IDX_CODE_FILEPATH, offsetof(db5_row, filepath), membersizeof(db5_row, filepath), true },
+	{ DB5_IDX_CODE_ALBUM,    offsetof(db5_row, album),    membersizeof(db5_row, album),    true },
+	{ DB5_IDX_CODE_GENRE,    offsetof(db5_row, genre),    membersizeof(db5_row, genre),    true },
+	{ DB5_IDX_CODE_TITLE,    offsetof(db5_row, title),    membersizeof(db5_row, title),    true },
+	{ DB5_IDX_CODE_ARTIST,   offsetof(db5_row, artist),   membersizeof(db5_row, artist),   true },
+	{ DB5_IDX_CODE_TRACK,    offsetof(db5_row, track),    membersizeof(db5_row, track),    false },
+	{ DB5_IDX_CODE_SOURCE,   offsetof(db5_row, source),   membersizeof(db5_row, source),   false },
+	{ DB5_IDX_CODE_DEV,      offsetof(db5_row, reserved), membersizeof(db5_row, reserved), false }
+};
+
+/** @brief number of indexed columns */
+#define columns_count	(sizeof(db5_index_columns)/sizeof(db5_index_column))
+
+/** @brief sorted entries of each indexed column, kept up to date by row modifications */
+static index_entry *db5_index_tables[columns_count];
+
+/** @brief number of entries in each table */
+static uint32_t db5_index_table_count;
+
+/** @brief number of entries allocated for each table */
+static uint32_t db5_index_table_size;
+
+/** @brief if tables match database rows */
+static bool db5_index_valid;
+
+/** @brief if database is too large for memory budget, indexes are then only sorted on disk */
+static bool db5_index_on_disk;
+
+/** @brief if table of each indexed column changed since its index file was written */
+static bool db5_index_dirty[columns_count];
+
+/** @brief number of modifications of table of each indexed column */
+static uint32_t db5_index_generation[columns_count];
+
+/** @brief bytes written to index file of each column since indexes were initialized */
+static uint64_t db5_index_written[columns_count];
+
+/** @brief fingerprint of index file of each column, as in fingerprints file */
+static index_fingerprint db5_index_fingerprints[columns_count];
+
+/** @brief fingerprints were modified since fingerprints file was written */
+static bool db5_index_fingerprints_changed;
+
+/** @brief lock of fingerprints, index files are written by several threads */
+static pthread_mutex_t db5_index_fingerprint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief copy of tables whose index file must be written */
+struct db5_index_snapshot
+{
+	/** @brief copy of tables, NULL for columns that are not written */
+	index_entry *tables[columns_count];
+	/** @brief generation of each copied table */
+	uint32_t generation[columns_count];
+	/** @brief number of entries in each table */
+	uint32_t count;
+};
+
+/** @brief lock of tables, for threads holding database lock for reading */
+static pthread_mutex_t db5_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief get index filename of a column
+ * @param code index code
+ * @param filename receives the filename
+ * @param size size of filename
+ */
+static void db5_index_filename(const uint32_t code, char *filename, const size_t size)
+{
+	snprintf(filename, size, CONFIG_DB5_IDX_FILE, byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+}
+
+/**
+ * @brief test if index file of a column holds a table
+ * @param code index code
+ * @param entries sorted entries of column
+ * @param count number of entries
+ * @return true if file content is the same as entries
+ */
+static bool db5_index_file_matches(const uint32_t code, const index_entry *entries, const uint32_t count)
 {
+	index_entry buffer[1024];
 	char filename[PATH_MAX];
-	db5_row row;
 	FILE *file;
-	uint32_t count, i;
-	index_entry *entries;
+	uint32_t done, number;
+	bool result;
 
-	check(reloffset < sizeof(db5_row));
-	check(reloffset+size <= sizeof(db5_row));
+	db5_index_filename(code, filename, sizeof(filename));
+	file = file_fcaseopen(CONFIG_DB5_DATA_DIR, filename, "rb");
+	if (file == NULL)
+	{
+		return false;
+	}
 
-	add_log(ADDLOG_DEBUG, "[db5/index]index_col", "generating index for code '%c%c%c%c'\n",
-		byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+	result = (file_filesize_f(file) == (off_t)count*sizeof(index_entry));
+	for(done=0; result && done < count; done += number)
+	{
+		number = (count-done < sizeof(buffer)/sizeof(index_entry) ? count-done : sizeof(buffer)/sizeof(index_entry));
+		result = (fread(buffer, sizeof(index_entry), number, file) == number)
+			&& (memcmp(buffer, entries+done, sizeof(index_entry)*number) == 0);
+	}
 
-	/* build index filename and open it */
-	snprintf(filename, sizeof(filename), CONFIG_DB5_IDX_FILE, byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
-	file = file_fcaseopen(CONFIG_DB5_DATA_DIR, filename, "wb");
-	if (file == NULL)
+	fclose(file);
+
+	return result;
+}
+
+/**
+ * @brief find a column by its index code
+ * @param code index code
+ * @return column number, columns_count if code is not indexed
+ */
+static unsigned int db5_index_column_of(const uint32_t code)
+{
+	unsigned int c;
+
+	for(c=0; c < columns_count && db5_index_columns[c].code != code; c++);
+
+	return c;
+}
+
+/**
+ * @brief get modification date of index file of a column
+ * @param code index code
+ * @param count expected number of entries
+ * @param date receives modification date
+ * @return true if index file exists and holds count entries
+ */
+static bool db5_index_file_date(const uint32_t code, const uint32_t count, uint32_t *date)
+{
+	char filename[PATH_MAX];
+	struct stat info;
+	bool result;
+	int file;
+
+	db5_index_filename(code, filename, sizeof(filename));
+	file = file_caseopen(CONFIG_DB5_DATA_DIR, filename, O_RDONLY);
+	if (file == -1)
 	{
-		add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to generate index file\n");
 		return false;
 	}
 
-	/* get number of entries */
-	count = db5_hdr_count();
-	if (count == 0)
+	result = (fstat(file, &info) == 0 && info.st_size == (off_t)count*sizeof(index_entry));
+	close(file);
+
+	if (result)
+	{
+		*date = (uint32_t)info.st_mtime;
+	}
+
+	return result;
+}
+
+/**
+ * @brief test if index file of a column holds a table, from fingerprint of last written file
+ * @param code index code
+ * @param entries sorted entries of column
+ * @param count number of entries
+ * @return true if fingerprint matches index file and entries
+ */
+static bool db5_index_fingerprint_matches(const uint32_t code, const index_entry *entries, const uint32_t count)
+{
+	index_fingerprint fingerprint;
+	unsigned int c;
+	uint32_t date;
+
+	c = db5_index_column_of(code);
+	if (c == columns_count)
 	{
-		add_log(ADDLOG_NOTICE, "[db5/index]index_col", "no data to index\n");
-		fclose(file);
 		return false;
 	}
 
-	/* memory allocating */
-	index_master_data = (char *)malloc(size*count);
-	if (index_master_data == NULL)
+	pthread_mutex_lock(&db5_index_fingerprint_lock);
+	fingerprint = db5_index_fingerprints[c];
+	pthread_mutex_unlock(&db5_index_fingerprint_lock);
+
+	/* a file written by another program has another date */
+	return (fingerprint.code == code && fingerprint.count == count
+		&& db5_index_file_date(code, count, &date) && fingerprint.date == date
+		&& fingerprint.crc == crc32((const char *)entries, (size_t)count*sizeof(index_entry)));
+}
+
+/**
+ * @brief record fingerprint of index file of a column, once it holds a table
+ * @param code index code
+ * @param entries sorted entries of column, NULL if index file content is unknown
+ * @param count number of entries
+ */
+static void db5_index_fingerprint_set(const uint32_t code, const index_entry *entries, const uint32_t count)
+{
+	index_fingerprint fingerprint;
+	unsigned int c;
+
+	c = db5_index_column_of(code);
+	if (c == columns_count)
+	{
+		return;
+	}
+
+	memset(&fingerprint, 0, sizeof(fingerprint));
+	if (entries != NULL && db5_index_file_date(code, count, &fingerprint.date))
+	{
+		fingerprint.code = code;
+		fingerprint.count = count;
+		fingerprint.crc = crc32((const char *)entries, (size_t)count*sizeof(index_entry));
+	}
+
+	pthread_mutex_lock(&db5_index_fingerprint_lock);
+	if (memcmp(&db5_index_fingerprints[c], &fingerprint, sizeof(fingerprint)) != 0)
+	{
+		db5_index_fingerprints[c] = fingerprint;
+		db5_index_fingerprints_changed = true;
+	}
+	pthread_mutex_unlock(&db5_index_fingerprint_lock);
+}
+
+/**
+ * @brief read fingerprints file, fingerprints are unknown if it is missing or invalid
+ */
+static void db5_index_fingerprint_load()
+{
+	FILE *file;
+	bool result;
+
+	pthread_mutex_lock(&db5_index_fingerprint_lock);
+
+	file = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_SUM_FILE, "rb");
+	result = (file != NULL && file_filesize_f(file) == sizeof(db5_index_fingerprints)
+		&& fread(db5_index_fingerprints, sizeof(db5_index_fingerprints), 1, file) == 1);
+	if (file != NULL)
 	{
-		add_log(ADDLOG_FAIL, "[db5/index]index_col", "not enought memory (%u entries)\n", count);
 		fclose(file);
+	}
+	if (!result)
+	{
+		memset(db5_index_fingerprints, 0, sizeof(db5_index_fingerprints));
+	}
+	db5_index_fingerprints_changed = false;
+
+	pthread_mutex_unlock(&db5_index_fingerprint_lock);
+}
+
+/**
+ * @brief write fingerprints file if fingerprints were modified
+ */
+static void db5_index_fingerprint_save()
+{
+	FILE *file;
+	bool result;
+
+	pthread_mutex_lock(&db5_index_fingerprint_lock);
+
+	if (!db5_index_fingerprints_changed)
+	{
+		pthread_mutex_unlock(&db5_index_fingerprint_lock);
+		return;
+	}
+
+	/* a partial file is never read: content is written aside, then replaces previous file */
+	file = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_SUM_FILE ".tmp", "wb");
+	result = (file != NULL && fwrite(db5_index_fingerprints, sizeof(db5_index_fingerprints), 1, file) == 1);
+	if (file != NULL)
+	{
+		result = (fclose(file) == 0) && result;
+	}
+	result = result && file_caserename(CONFIG_DB5_DATA_DIR, CONFIG_DB5_SUM_FILE ".tmp", CONFIG_DB5_SUM_FILE);
+	if (result)
+	{
+		db5_index_fingerprints_changed = false;
+	}
+	else
+	{
+		/* index files are compared to tables on next start */
+		add_log(ADDLOG_RECOVER, "[db5/index]fingerprint", "unable to write index fingerprints\n");
+		file_caseremove(CONFIG_DB5_DATA_DIR, CONFIG_DB5_SUM_FILE ".tmp");
+	}
+
+	pthread_mutex_unlock(&db5_index_fingerprint_lock);
+}
+
+/**
+ * @brief compute unique identifier of a key
+ * @param column the indexed column
+ * @param key the key
+ * @return unique identifier
+ */
+static uint32_t db5_index_uid(const db5_index_column *column, const char *key)
+{
+	uint32_t uid;
+
+	if (column->size <= sizeof(uid))
+	{
+		uid = 0;
+		memcpy(&uid, key, column->size);
+	}
+	else
+	{
+		uid = crc32(key, column->size);
+	}
+
+	return uid;
+}
+
+/**
+ * @brief write index file of a column, unless it already holds the same entries
+ * @param code index code
+ * @param entries sorted entries of column
+ * @param count number of entries
+ * @return true if successfull
+ */
+static bool db5_index_write_table(const uint32_t code, const index_entry *entries, const uint32_t count)
+{
+	char filename[PATH_MAX];
+	char tempname[PATH_MAX];
+	unsigned int c;
+	FILE *file;
+	bool result;
+
+	/* flash memory is not worn by identical content, file is read back only without fingerprint */
+	if (db5_index_fingerprint_matches(code, entries, count) || db5_index_file_matches(code, entries, count))
+	{
+		add_log(ADDLOG_DEBUG, "[db5/index]index_col", "index file '%c%c%c%c' is identical, not written\n",
+			byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+		db5_index_fingerprint_set(code, entries, count);
+		return true;
+	}
+
+	/* player never reads a partial file: content is written aside, then replaces previous file */
+	db5_index_filename(code, filename, sizeof(filename));
+	snprintf(tempname, sizeof(tempname), CONFIG_DB5_IDX_FILE ".tmp", byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+
+	file = file_fcaseopen(CONFIG_DB5_DATA_DIR, tempname, "wb");
+	if (file == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to generate index file\n");
 		return false;
 	}
 
-	entries = (index_entry *)malloc(sizeof(index_entry)*count);
-	if (entries == NULL)
+	result = (fwrite(entries, sizeof(index_entry), count, file) == count)
+		&& (fflush(file) == 0)
+		&& (fdatasync(fileno(file)) == 0);
+	fclose(file);
+
+	if (!result)
 	{
-		add_log(ADDLOG_FAIL, "[db5/index]index_col", "not enought memory (%u entries)\n", count);
-		free(index_master_data), fclose(file);
+		add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to wire index data to file '%c%c%c%c'\n",
+			byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+		file_caseremove(CONFIG_DB5_DATA_DIR, tempname);
+		return false;
+	}
+
+	if (!file_caserename(CONFIG_DB5_DATA_DIR, tempname, filename))
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to replace index file '%c%c%c%c'\n",
+			byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+		file_caseremove(CONFIG_DB5_DATA_DIR, tempname);
 		return false;
 	}
 
-	/* load master data in memory and prepare results */
-	index_entry_size = size;
+	/* each column is written by one thread at a time */
+	c = db5_index_column_of(code);
+	if (c < columns_count)
+	{
+		db5_index_written[c] += (uint64_t)count*sizeof(index_entry);
+	}
 
-	for(i=0; i < count; i++)
+	db5_index_fingerprint_set(code, entries, count);
+
+	return true;
+}
+
+/**
+ * @brief sort entries by insertion, keys are equal before depth
+ * @param entries entries to sort
+ * @param count number of entries
+ * @param depth number of bytes already sorted
+ * @param keys keys of column
+ */
+static void db5_index_insertion_sort(index_entry *entries, const uint32_t count, const size_t depth, const index_keys *keys)
+{
+	index_entry current;
+	uint32_t i, j;
+
+	for(i=1; i < count; i++)
 	{
-		if (!db5_dat_select_row(i, &row))
+		current = entries[i];
+		for(j=i; j > 0; j--)
 		{
-			add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to read entry %u\n", i);
-			free(index_master_data), free(entries), fclose(file);
-			return false;
+			/* entries are in position order: stopping on equal keys keeps it */
+			if (memcmp(keys->data+entries[j-1].position*keys->size+depth,
+				keys->data+current.position*keys->size+depth, keys->size-depth) <= 0)
+			{
+				break;
+			}
+			entries[j] = entries[j-1];
 		}
-		memcpy(index_master_data+i*size, ((char *)&row)+reloffset, size);
+		entries[j] = current;
+	}
+}
 
-		entries[i].hidden = row.hidden;
-		entries[i].position = i;
+/**
+ * @brief sort entries by most significant byte first, keys are equal before depth
+ * @param entries entries to sort, in position order for equal keys
+ * @param buffer buffer of count entries
+ * @param count number of entries
+ * @param depth number of bytes already sorted
+ * @param keys keys of column
+ */
+static void db5_index_radix_msd(index_entry *entries, index_entry *buffer, const uint32_t count, size_t depth, const index_keys *keys)
+{
+	uint32_t buckets[257];
+	uint32_t i;
+	unsigned int b;
+
+	if (count < radix_cutoff)
+	{
+		db5_index_insertion_sort(entries, count, depth, keys);
+		return;
 	}
 
-	/* generate uid */
-	if (size <= membersizeof(index_entry, uid))
+	/* skip bytes shared by all keys, as padding of strings */
+	for(; depth < keys->size; depth++)
 	{
+		memset(buckets, 0, sizeof(buckets));
 		for(i=0; i < count; i++)
 		{
-			entries[i].uid = 0;
-			memcpy(&entries[i].uid, index_master_data+i*size, size);
+			buckets[(unsigned char)keys->data[entries[i].position*keys->size+depth]+1]++;
+		}
+
+		for(b=1; b <= 256 && buckets[b] != count; b++);
+		if (b > 256)
+		{
+			break;
 		}
 	}
-	else
+
+	/* all keys are equal */
+	if (depth == keys->size)
 	{
-		for(i=0; i < count; i++)
+		return;
+	}
+
+	/* stable distribution, equal keys stay in position order */
+	for(b=1; b <= 256; b++)
+	{
+		buckets[b] += buckets[b-1];
+	}
+	for(i=0; i < count; i++)
+	{
+		buffer[buckets[(unsigned char)keys->data[entries[i].position*keys->size+depth]]++] = entries[i];
+	}
+	memcpy(entries, buffer, sizeof(index_entry)*count);
+
+	/* buckets[b] is now the end of bucket b */
+	for(b=0, i=0; b < 256; i=buckets[b], b++)
+	{
+		if (buckets[b] - i > 1)
 		{
-			entries[i].uid = crc32(index_master_data+i*size, size);
+			db5_index_radix_msd(entries+i, buffer+i, buckets[b]-i, depth+1, keys);
 		}
 	}
+}
 
-	/* sort data */
-	qsort(entries, count, sizeof(index_entry), db5_index_compare_entries);
+/**
+ * @brief sort entries by least significant byte first, for short keys
+ * @param entries entries to sort, in position order for equal keys
+ * @param buffer buffer of count entries
+ * @param count number of entries
+ * @param keys keys of column
+ */
+static void db5_index_radix_lsd(index_entry *entries, index_entry *buffer, const uint32_t count, const index_keys *keys)
+{
+	uint32_t buckets[257];
+	index_entry *from, *to, *swap;
+	uint32_t i;
+	size_t depth;
+	unsigned int b;
 
-#ifdef DEBUG
-	index_dump_table(entries, count);
-#endif
+	from = entries;
+	to = buffer;
 
-	/* save data */
-	if (fwrite(entries, sizeof(index_entry), count, file) != count)
+	for(depth = keys->size; depth > 0; depth--)
 	{
-		add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to wire index data to file '%s'\n", filename);
-		free(index_master_data), free(entries), fclose(file);
-		return false;
+		memset(buckets, 0, sizeof(buckets));
+		for(i=0; i < count; i++)
+		{
+			buckets[(unsigned char)keys->data[from[i].position*keys->size+depth-1]+1]++;
+		}
+
+		/* byte is the same for all keys */
+		for(b=1; b <= 256 && buckets[b] != count; b++);
+		if (b <= 256)
+		{
+			continue;
+		}
+
+		for(b=1; b <= 256; b++)
+		{
+			buckets[b] += buckets[b-1];
+		}
+		for(i=0; i < count; i++)
+		{
+			to[buckets[(unsigned char)keys->data[from[i].position*keys->size+depth-1]]++] = from[i];
+		}
+
+		swap = from, from = to, to = swap;
 	}
 
-	free(index_master_data);
-	free(entries);
-	fclose(file);
+	if (from != entries)
+	{
+		memcpy(entries, from, sizeof(index_entry)*count);
+	}
+}
+
+/**
+ * @brief sort entries by key, then by position
+ * @param entries entries to sort, in position order
+ * @param count number of entries
+ * @param keys keys of column
+ * @param radix use radix sort, else qsort
+ */
+static void db5_index_sort_entries(index_entry *entries, const uint32_t count, const index_keys *keys, const bool radix)
+{
+	index_entry *buffer;
 
-	add_log(ADDLOG_DEBUG, "[db5/index]index_col", "done.\n");
+	buffer = NULL;
+	if (radix && count > 0)
+	{
+		buffer = (index_entry *)malloc(sizeof(index_entry)*count);
+	}
 
-	return true;
+	/* fixed-width keys: bytes are sorted one by one */
+	if (buffer != NULL)
+	{
+		if (keys->size <= sizeof(uint32_t))
+		{
+			db5_index_radix_lsd(entries, buffer, count, keys);
+		}
+		else
+		{
+			db5_index_radix_msd(entries, buffer, count, 0, keys);
+		}
+		free(buffer);
+	}
+	else
+	{
+		qsort_r(entries, count, sizeof(index_entry), db5_index_compare_entries, (void *)keys);
+	}
 }
 
+/**
+ * @brief sort keys of a column
+ * @param column the indexed column
+ * @param data keys of column, one per row
+ * @param hidden hidden flag of rows
+ * @param positions positions of rows to index
+ * @param count number of rows to index
+ * @return sorted entries, to be freed, or NULL if error
+ */
+static index_entry *db5_index_sort_column(const db5_index_column *column, const char *data, const uint32_t *hidden,
+	const uint32_t *positions, const uint32_t count)
+{
+	uint32_t i;
+	index_entry *entries;
+	index_keys keys;
+
+	entries = (index_entry *)malloc(sizeof(index_entry)*(count > 0 ? count : 1));
+	if (entries == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]index_col", "not enought memory (%u entries)\n", count);
+		return NULL;
+	}
+
+	/* prepare results and generate uid */
+	for(i=0; i < count; i++)
+	{
+		entries[i].hidden = hidden[positions[i]];
+		entries[i].position = positions[i];
+		entries[i].uid = db5_index_uid(column, data+positions[i]*column->size);
+	}
+
+	/* sort data */
+	keys.data = data;
+	keys.size = column->size;
+	db5_index_sort_entries(entries, count, &keys, true);
+
+#ifdef DEBUG
+	index_dump_table(entries, count);
+#endif
+
+	return entries;
+}
+
+/**
+ * @brief index generation thread, columns are taken one by one from the pool
+ * @param arg the pool
+ * @return NULL
+ */
+static void *db5_index_worker(void *arg)
+{
+	index_pool *pool;
+	const db5_index_column *column;
+	index_entry *entries;
+	struct timespec start, end;
+	unsigned int c;
+	bool result;
+
+	pool = (index_pool *)arg;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&pool->lock);
+		c = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (c >= pool->number)
+		{
+			break;
+		}
+
+		column = &pool->columns[c];
+		add_log(ADDLOG_DEBUG, "[db5/index]index_col", "generating index for code '%c%c%c%c'\n",
+			byteof(column->code, 0), byteof(column->code, 1), byteof(column->code, 2), byteof(column->code, 3));
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		entries = db5_index_sort_column(column, pool->data[c], pool->hidden, pool->positions, pool->count);
+		result = (entries != NULL);
+
+		if (result && pool->write)
+		{
+			result = db5_index_write_table(column->code, entries, pool->count);
+		}
+
+		if (pool->tables != NULL)
+		{
+			pool->tables[c] = entries;
+		}
+		else
+		{
+			free(entries);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		add_log(ADDLOG_DEBUG, "[db5/index]index_col", "index '%c%c%c%c' done in %.3f ms\n",
+			byteof(column->code, 0), byteof(column->code, 1), byteof(column->code, 2), byteof(column->code, 3),
+			(end.tv_sec-start.tv_sec)*1e3 + (end.tv_nsec-start.tv_nsec)/1e6);
+
+		if (!result)
+		{
+			pthread_mutex_lock(&pool->lock);
+			pool->result = false;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief index columns in parallel, one task per column
+ * @param pool columns to index
+ * @return true if all columns are indexed
+ */
+static bool db5_index_run_pool(index_pool *pool)
+{
+	pthread_t threads[columns_count];
+	unsigned int wanted, started, t;
+	long processors;
+
+	wanted = CONFIG_DB5_INDEX_THREADS;
+	if (wanted == 0)
+	{
+		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		wanted = (processors > 0 ? (unsigned int)processors : 1);
+	}
+	if (wanted > pool->number)
+	{
+		wanted = pool->number;
+	}
+
+	pool->next = 0;
+	pool->result = true;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	/* current thread is one of the workers */
+	for(started=0; started+1 < wanted; started++)
+	{
+		if (pthread_create(&threads[started], NULL, db5_index_worker, pool) != 0)
+		{
+			add_log(ADDLOG_RECOVER, "[db5/index]index", "unable to start thread, %u threads used\n", started+1);
+			break;
+		}
+	}
+
+	db5_index_worker(pool);
+
+	for(t=0; t < started; t++)
+	{
+		pthread_join(threads[t], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+
+	return pool->result;
+}
+
+/**
+ * @brief sort several columns, database rows are read once
+ * @param columns the columns to index
+ * @param number number of columns
+ * @param tables receives sorted entries of each column if not NULL, to be freed
+ * @param count receives number of entries of each column
+ * @param write if index files are written
+ * @return true if all columns are indexed
+ */
+static bool db5_index_build(const db5_index_column *columns, const unsigned int number,
+	index_entry **tables, uint32_t *count, const bool write)
+{
+	const db5_row *row;
+	char *data[columns_count];
+	uint32_t *hidden, *positions;
+	uint32_t rows, live, i;
+	unsigned int c;
+	bool loaded, result;
+	index_pool pool;
+
+	check(number <= columns_count);
+	check(count != NULL);
+
+	/* get number of entries */
+	rows = db5_hdr_count();
+	*count = 0;
+
+	/* memory allocating */
+	hidden = (uint32_t *)malloc(sizeof(uint32_t)*(rows > 0 ? rows : 1));
+	positions = (uint32_t *)malloc(sizeof(uint32_t)*(rows > 0 ? rows : 1));
+	result = (hidden != NULL && positions != NULL);
+	for(c=0; c < number; c++)
+	{
+		data[c] = (char *)malloc(columns[c].size*(rows > 0 ? rows : 1));
+		result = result && (data[c] != NULL);
+	}
+	if (!result)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]index_col", "not enought memory (%u entries)\n", rows);
+		for(c=0; c < number; c++)
+		{
+			free(data[c]);
+		}
+		free(positions);
+		free(hidden);
+		return false;
+	}
+
+	/* load keys of all columns in a single pass, deleted rows are not indexed */
+	loaded = true;
+	live = 0;
+	for(i=0; i < rows; i++)
+	{
+		row = db5_dat_row(i);
+		if (row == NULL)
+		{
+			add_log(ADDLOG_FAIL, "[db5/index]index_col", "unable to read entry %u\n", i);
+			loaded = false;
+			break;
+		}
+
+		for(c=0; c < number; c++)
+		{
+			memcpy(data[c]+i*columns[c].size, ((const char *)row)+columns[c].offset, columns[c].size);
+		}
+		hidden[i] = row->hidden;
+
+		if (!db5_dat_deleted(i))
+		{
+			positions[live++] = i;
+		}
+	}
+
+	/* columns are indexed independently */
+	result = loaded;
+	if (loaded)
+	{
+		pool.columns = columns;
+		pool.data = data;
+		pool.hidden = hidden;
+		pool.positions = positions;
+		pool.count = live;
+		pool.tables = tables;
+		pool.write = write;
+		pool.number = number;
+
+		result = db5_index_run_pool(&pool);
+		*count = live;
+	}
+
+	for(c=0; c < number; c++)
+	{
+		free(data[c]);
+	}
+	free(positions);
+	free(hidden);
+
+	return result;
+}
+
+/**
+ * @brief estimate memory used to sort all columns in memory
+ * @param rows number of rows
+ * @return size in bytes
+ */
+static uint64_t db5_index_memory(const uint32_t rows)
+{
+	uint64_t size;
+	unsigned int c;
+
+	/* hidden flags, positions, then keys and sorted entries of each column */
+	size = 2*sizeof(uint32_t);
+	for(c=0; c < columns_count; c++)
+	{
+		size += db5_index_columns[c].size + sizeof(index_entry);
+	}
+
+	return size*rows;
+}
+
+/**
+ * @brief sort a column by runs fitting in memory budget, runs are written to a file
+ * @param column the indexed column
+ * @param runs file receiving runs, records are an index entry followed by its key
+ * @param bounds receives end of each run, in records, to be freed
+ * @param number receives number of runs
+ * @return true if successfull
+ */
+static bool db5_index_external_runs(const db5_index_column *column, FILE *runs, uint32_t **bounds, uint32_t *number)
+{
+	const db5_row *row;
+	index_entry *entries, entry;
+	uint32_t *positions, *more;
+	char *data;
+	index_keys keys;
+	uint32_t rows, run_rows, records, i, n, j;
+	bool result;
+
+	*bounds = NULL;
+	*number = 0;
+
+	/* keys, positions, entries and radix buffer of a run */
+	run_rows = CONFIG_DB5_INDEX_MEMORY / (column->size + sizeof(uint32_t) + 2*sizeof(index_entry));
+	if (run_rows < radix_cutoff)
+	{
+		run_rows = radix_cutoff;
+	}
+
+	data = (char *)malloc(column->size*run_rows);
+	positions = (uint32_t *)malloc(sizeof(uint32_t)*run_rows);
+	entries = (index_entry *)malloc(sizeof(index_entry)*run_rows);
+	if (data == NULL || positions == NULL || entries == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]external", "not enought memory (%u entries)\n", run_rows);
+		free(data), free(positions), free(entries);
+		return false;
+	}
+
+	keys.data = data;
+	keys.size = column->size;
+
+	rows = db5_hdr_count();
+	records = 0;
+	result = true;
+	for(i=0; result && i < rows; )
+	{
+		/* load a run, deleted rows are not indexed */
+		for(n=0; i < rows && n < run_rows; i++)
+		{
+			row = db5_dat_row(i);
+			if (row == NULL)
+			{
+				add_log(ADDLOG_FAIL, "[db5/index]external", "unable to read entry %u\n", i);
+				result = false;
+				break;
+			}
+			if (db5_dat_deleted(i))
+			{
+				continue;
+			}
+
+			memcpy(data+n*column->size, ((const char *)row)+column->offset, column->size);
+			positions[n] = i;
+			entries[n].hidden = row->hidden;
+			entries[n].position = n;
+			entries[n].uid = db5_index_uid(column, data+n*column->size);
+			n++;
+		}
+
+		if (!result || n == 0)
+		{
+			break;
+		}
+
+		/* positions of a run are increasing: equal keys stay in position order */
+		db5_index_sort_entries(entries, n, &keys, true);
+
+		for(j=0; result && j < n; j++)
+		{
+			entry = entries[j];
+			entry.position = positions[entries[j].position];
+			result = (fwrite(&entry, sizeof(index_entry), 1, runs) == 1)
+				&& (fwrite(data+entries[j].position*column->size, column->size, 1, runs) == 1);
+		}
+		records += n;
+
+		more = (uint32_t *)realloc(*bounds, sizeof(uint32_t)*(*number+1));
+		if (more == NULL)
+		{
+			add_log(ADDLOG_FAIL, "[db5/index]external", "not enought memory (%u runs)\n", *number+1);
+			result = false;
+			break;
+		}
+		*bounds = more;
+		(*bounds)[(*number)++] = records;
+	}
+
+	free(data), free(positions), free(entries);
+
+	if (!result)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]external", "unable to write sorted runs\n");
+	}
+
+	return result && (fflush(runs) == 0);
+}
+
+/** @brief read cursor on a run of external sort */
+typedef struct
+{
+	/** @brief records read from run */
+	char *buffer;
+	/** @brief number of records in buffer */
+	uint32_t buffered;
+	/** @brief next record of buffer */
+	uint32_t next;
+	/** @brief next record of run to read */
+	uint32_t first;
+	/** @brief end of run, in records */
+	uint32_t last;
+} index_run;
+
+/**
+ * @brief get current record of a run
+ * @param run the run
+ * @param record size of a record
+ * @return the record, an index entry followed by its key
+ */
+#define db5_index_run_record(run,record)	((run)->buffer + (size_t)(run)->next*(record))
+
+/**
+ * @brief compare current records of two runs, equal keys are ordered by position
+ * @param run1 first run
+ * @param run2 second run
+ * @param size size of a key
+ * @return postive if run1 > run2, negative else
+ */
+static int db5_index_compare_runs(const index_run *run1, const index_run *run2, const size_t size)
+{
+	const char *record1, *record2;
+	uint32_t pos1, pos2;
+	int result;
+
+	record1 = db5_index_run_record(run1, sizeof(index_entry)+size);
+	record2 = db5_index_run_record(run2, sizeof(index_entry)+size);
+
+	result = memcmp(record1+sizeof(index_entry), record2+sizeof(index_entry), size);
+	if (result == 0)
+	{
+		pos1 = ((const index_entry *)record1)->position;
+		pos2 = ((const index_entry *)record2)->position;
+		result = (pos1 > pos2) - (pos1 < pos2);
+	}
+
+	return result;
+}
+
+/**
+ * @brief read next records of a run
+ * @param run the run
+ * @param runs file of runs
+ * @param record size of a record
+ * @param capacity number of records of buffer
+ * @return true if records are available
+ */
+static bool db5_index_run_fill(index_run *run, FILE *runs, const size_t record, const uint32_t capacity)
+{
+	uint32_t n;
+
+	n = (run->last - run->first < capacity ? run->last - run->first : capacity);
+	if (n == 0)
+	{
+		return false;
+	}
+
+	if (pread(fileno(runs), run->buffer, n*record, (off_t)run->first*record) != (ssize_t)(n*record))
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]external", "unable to read sorted runs\n");
+		return false;
+	}
+
+	run->first += n;
+	run->buffered = n;
+	run->next = 0;
+
+	return true;
+}
+
+/**
+ * @brief restore heap order from a node down
+ * @param heap runs ordered by current record
+ * @param count number of runs in heap
+ * @param node the node
+ * @param size size of a key
+ */
+static void db5_index_heap_down(index_run **heap, const uint32_t count, uint32_t node, const size_t size)
+{
+	index_run *swap;
+	uint32_t child;
+
+	for(;;)
+	{
+		child = 2*node+1;
+		if (child >= count)
+		{
+			break;
+		}
+		if (child+1 < count && db5_index_compare_runs(heap[child+1], heap[child], size) < 0)
+		{
+			child++;
+		}
+		if (db5_index_compare_runs(heap[node], heap[child], size) <= 0)
+		{
+			break;
+		}
+
+		swap = heap[node], heap[node] = heap[child], heap[child] = swap;
+		node = child;
+	}
+}
+
+/**
+ * @brief merge sorted runs into index file
+ * @param column the indexed column
+ * @param runs file of runs
+ * @param bounds end of each run, in records
+ * @param number number of runs
+ * @param file index file
+ * @return true if successfull
+ */
+static bool db5_index_external_merge(const db5_index_column *column, FILE *runs, const uint32_t *bounds, const uint32_t number, FILE *file)
+{
+	index_run *cursors, **heap;
+	size_t record;
+	uint32_t capacity, count, r;
+	bool result;
+
+	if (number == 0)
+	{
+		return true;
+	}
+
+	/* memory budget is shared by buffers of runs */
+	record = sizeof(index_entry) + column->size;
+	capacity = CONFIG_DB5_INDEX_MEMORY / (number*record);
+	if (capacity < 16)
+	{
+		capacity = 16;
+	}
+
+	cursors = (index_run *)calloc(number, sizeof(index_run));
+	heap = (index_run **)malloc(sizeof(index_run *)*number);
+	result = (cursors != NULL && heap != NULL);
+	for(r=0; result && r < number; r++)
+	{
+		cursors[r].buffer = (char *)malloc(capacity*record);
+		result = (cursors[r].buffer != NULL);
+	}
+	if (!result)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]external", "not enought memory (%u runs)\n", number);
+	}
+
+	/* first records of each run */
+	count = 0;
+	for(r=0; result && r < number; r++)
+	{
+		cursors[r].first = (r > 0 ? bounds[r-1] : 0);
+		cursors[r].last = bounds[r];
+		if (db5_index_run_fill(&cursors[r], runs, record, capacity))
+		{
+			heap[count++] = &cursors[r];
+		}
+	}
+	for(r = count/2; result && r > 0; r--)
+	{
+		db5_index_heap_down(heap, count, r-1, column->size);
+	}
+
+	/* smallest record is always on top */
+	while(result && count > 0)
+	{
+		result = (fwrite(db5_index_run_record(heap[0], record), sizeof(index_entry), 1, file) == 1);
+
+		heap[0]->next++;
+		if (heap[0]->next == heap[0]->buffered && !db5_index_run_fill(heap[0], runs, record, capacity))
+		{
+			heap[0] = heap[--count];
+		}
+		db5_index_heap_down(heap, count, 0, column->size);
+	}
+
+	for(r=0; cursors != NULL && r < number; r++)
+	{
+		free(cursors[r].buffer);
+	}
+	free(cursors);
+	free(heap);
+
+	return result;
+}
+
+/**
+ * @brief write index file of a column without loading all its keys in memory
+ * @param column the indexed column
+ * @return true if successfull
+ */
+static bool db5_index_external_column(const db5_index_column *column)
+{
+	char runname[PATH_MAX];
+	char filename[PATH_MAX];
+	char tempname[PATH_MAX];
+	FILE *runs, *file;
+	uint32_t *bounds, number;
+	unsigned int c;
+	off_t size;
+	bool result;
+
+	snprintf(runname, sizeof(runname), CONFIG_DB5_IDX_FILE ".run", byteof(column->code, 0), byteof(column->code, 1), byteof(column->code, 2), byteof(column->code, 3));
+	snprintf(tempname, sizeof(tempname), CONFIG_DB5_IDX_FILE ".tmp", byteof(column->code, 0), byteof(column->code, 1), byteof(column->code, 2), byteof(column->code, 3));
+	db5_index_filename(column->code, filename, sizeof(filename));
+
+	runs = file_fcaseopen(CONFIG_DB5_DATA_DIR, runname, "wb+");
+	file = file_fcaseopen(CONFIG_DB5_DATA_DIR, tempname, "wb");
+	if (runs == NULL || file == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]external", "unable to create temporary files\n");
+		if (runs != NULL)
+		{
+			fclose(runs);
+		}
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+		file_caseremove(CONFIG_DB5_DATA_DIR, runname);
+		file_caseremove(CONFIG_DB5_DATA_DIR, tempname);
+		return false;
+	}
+
+	result = db5_index_external_runs(column, runs, &bounds, &number);
+	result = result && db5_index_external_merge(column, runs, bounds, number, file);
+	result = result && (fflush(file) == 0) && (fdatasync(fileno(file)) == 0);
+	size = file_filesize_f(file);
+
+	free(bounds);
+	fclose(runs);
+	fclose(file);
+	file_caseremove(CONFIG_DB5_DATA_DIR, runname);
+
+	/* entries are not in memory, content of file is not known */
+	result = result && file_caserename(CONFIG_DB5_DATA_DIR, tempname, filename);
+	db5_index_fingerprint_set(column->code, NULL, 0);
+	if (!result)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]external", "unable to generate index file '%c%c%c%c'\n",
+			byteof(column->code, 0), byteof(column->code, 1), byteof(column->code, 2), byteof(column->code, 3));
+		file_caseremove(CONFIG_DB5_DATA_DIR, tempname);
+	}
+	else
+	{
+		c = db5_index_column_of(column->code);
+		if (c < columns_count)
+		{
+			db5_index_written[c] += size;
+		}
+	}
+
+	add_log(ADDLOG_DEBUG, "[db5/index]external", "index '%c%c%c%c' merged from %u runs\n",
+		byteof(column->code, 0), byteof(column->code, 1), byteof(column->code, 2), byteof(column->code, 3), number);
+
+	return result;
+}
+
+/**
+ * @brief mark table of a column as modified
+ * @param c column number
+ */
+static void db5_index_touch(const unsigned int c)
+{
+	db5_index_dirty[c] = true;
+	db5_index_generation[c]++;
+}
+
+/**
+ * @brief replace tables of all columns, index lock must be held
+ * @param tables new tables, NULL to drop tables
+ * @param count number of entries of each table
+ */
+static void db5_index_set_tables(index_entry **tables, const uint32_t count)
+{
+	unsigned int c;
+
+	for(c=0; c < columns_count; c++)
+	{
+		free(db5_index_tables[c]);
+		db5_index_tables[c] = (tables != NULL ? tables[c] : NULL);
+		db5_index_touch(c);
+	}
+
+	db5_index_table_count = (tables != NULL ? count : 0);
+	db5_index_table_size = db5_index_table_count;
+	db5_index_valid = (tables != NULL);
+}
+
+/**
+ * @brief sort all columns into tables
+ * @param write if index files are written, else index files are compared to tables
+ * @return true if successfull
+ */
+static bool db5_index_build_tables(const bool write)
+{
+	index_entry *tables[columns_count];
+	uint32_t count;
+	unsigned int c;
+	bool result;
+
+	memset(tables, 0, sizeof(tables));
+
+	/* database too large for memory budget: no tables, index files are sorted on disk */
+	db5_index_on_disk = (db5_index_memory(db5_hdr_count()) > CONFIG_DB5_INDEX_MEMORY);
+	if (db5_index_on_disk)
+	{
+		add_log(ADDLOG_NOTICE, "[db5/index]index", "database is too large for memory, indexes are sorted on disk\n");
+		db5_index_set_tables(NULL, 0);
+
+		result = true;
+		for(c=0; write && c < columns_count; c++)
+		{
+			result = db5_index_external_column(&db5_index_columns[c]) && result;
+		}
+
+		return result;
+	}
+
+	result = db5_index_build(db5_index_columns, columns_count, tables, &count, write);
+	if (!result)
+	{
+		for(c=0; c < columns_count; c++)
+		{
+			free(tables[c]);
+		}
+	}
+
+	db5_index_set_tables(result ? tables : NULL, count);
+
+	/* index files left by previous session may be up to date, as their fingerprints tell */
+	for(c=0; result && c < columns_count; c++)
+	{
+		db5_index_dirty[c] = (!write && !db5_index_fingerprint_matches(db5_index_columns[c].code, tables[c], count));
+	}
+
+	return result;
+}
+
+/**
+ * @brief compare a key to an index entry, equal keys are ordered by position
+ * @param column the indexed column
+ * @param key the key
+ * @param position row position of key
+ * @param entry the index entry
+ * @return postive if key > entry, negative else
+ */
+static int db5_index_compare_key(const db5_index_column *column, const char *key, const uint32_t position, const index_entry *entry)
+{
+	int result;
+
+	result = memcmp(key, ((const char *)db5_dat_row(entry->position))+column->offset, column->size);
+	if (result == 0)
+	{
+		result = (position > entry->position) - (position < entry->position);
+	}
+
+	return result;
+}
+
+/**
+ * @brief find where a row is or would be in a table
+ * @param c column number
+ * @param row the row
+ * @param position row position
+ * @param count number of entries in table
+ * @return index of first entry not lower than row
+ */
+static uint32_t db5_index_search(const unsigned int c, const db5_row *row, const uint32_t position, const uint32_t count)
+{
+	const char *key;
+	uint32_t low, high, middle;
+
+	key = ((const char *)row)+db5_index_columns[c].offset;
+
+	low = 0;
+	high = count;
+	while(low < high)
+	{
+		middle = low + (high-low)/2;
+		if (db5_index_compare_key(&db5_index_columns[c], key, position, &db5_index_tables[c][middle]) > 0)
+		{
+			low = middle+1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/**
+ * @brief insert a row in table of a column, table must have room for it
+ * @param c column number
+ * @param row the row
+ * @param position row position
+ * @param count number of entries in table
+ */
+static void db5_index_table_insert(const unsigned int c, const db5_row *row, const uint32_t position, const uint32_t count)
+{
+	index_entry *table;
+	uint32_t i;
+
+	table = db5_index_tables[c];
+	i = db5_index_search(c, row, position, count);
+
+	memmove(&table[i+1], &table[i], sizeof(index_entry)*(count-i));
+	table[i].hidden = row->hidden;
+	table[i].position = position;
+	table[i].uid = db5_index_uid(&db5_index_columns[c], ((const char *)row)+db5_index_columns[c].offset);
+
+	db5_index_touch(c);
+}
+
+/**
+ * @brief remove a row from table of a column
+ * @param c column number
+ * @param row the row, as it was indexed
+ * @param position row position
+ * @return true if row was found
+ */
+static bool db5_index_table_remove(const unsigned int c, const db5_row *row, const uint32_t position)
+{
+	index_entry *table;
+	uint32_t i;
+
+	table = db5_index_tables[c];
+	i = db5_index_search(c, row, position, db5_index_table_count);
+
+	if (i >= db5_index_table_count || table[i].position != position)
+	{
+		add_log(ADDLOG_RECOVER, "[db5/index]remove", "row %u is not indexed, indexes will be regenerated\n", position);
+		return false;
+	}
+
+	memmove(&table[i], &table[i+1], sizeof(index_entry)*(db5_index_table_count-i-1));
+
+	db5_index_touch(c);
+
+	return true;
+}
+
+bool db5_index_init()
+{
+	bool result;
+	unsigned int c, dirty;
+
+	pthread_mutex_lock(&db5_index_lock);
+	memset(db5_index_written, 0, sizeof(db5_index_written));
+	db5_index_fingerprint_load();
+	result = db5_index_build_tables(false);
+	for(c=0, dirty=0; c < columns_count; c++)
+	{
+		dirty += (db5_index_dirty[c] ? 1 : 0);
+	}
+	pthread_mutex_unlock(&db5_index_lock);
+
+	if (!result)
+	{
+		add_log(ADDLOG_RECOVER, "[db5/index]init", "unable to load indexes, they will be generated on demand\n");
+	}
+	else if (db5_index_on_disk)
+	{
+		add_log(ADDLOG_NOTICE, "[db5/index]init", "no in-memory indexes, lookups use database rows\n");
+	}
+	else if (dirty > 0)
+	{
+		add_log(ADDLOG_NOTICE, "[db5/index]init", "%u index files are out of date\n", dirty);
+	}
+
+	return result;
+}
+
+void db5_index_free()
+{
+	pthread_mutex_lock(&db5_index_lock);
+	db5_index_set_tables(NULL, 0);
+	pthread_mutex_unlock(&db5_index_lock);
+}
+
+void db5_index_insert_row(const uint32_t position)
+{
+	index_entry *table;
+	const db5_row *row;
+	uint32_t size;
+	unsigned int c;
+
+	if (!db5_index_valid)
+	{
+		return;
+	}
+
+	row = db5_dat_row(position);
+	if (row == NULL)
+	{
+		db5_index_invalidate();
+		return;
+	}
+
+	/* tables grow together */
+	if (db5_index_table_count == db5_index_table_size)
+	{
+		size = 2*db5_index_table_size + 64;
+		for(c=0; c < columns_count; c++)
+		{
+			table = (index_entry *)realloc(db5_index_tables[c], sizeof(index_entry)*size);
+			if (table == NULL)
+			{
+				add_log(ADDLOG_RECOVER, "[db5/index]insert", "not enought memory (%u entries), indexes will be regenerated\n", size);
+				db5_index_invalidate();
+				return;
+			}
+			db5_index_tables[c] = table;
+		}
+		db5_index_table_size = size;
+	}
+
+	for(c=0; c < columns_count; c++)
+	{
+		db5_index_table_insert(c, row, position, db5_index_table_count);
+	}
+
+	db5_index_table_count++;
+}
+
+void db5_index_remove_row(const uint32_t position)
+{
+	const db5_row *row;
+	unsigned int c;
+
+	if (!db5_index_valid)
+	{
+		return;
+	}
+
+	row = db5_dat_row(position);
+	if (row == NULL)
+	{
+		db5_index_invalidate();
+		return;
+	}
+
+	for(c=0; c < columns_count; c++)
+	{
+		if (!db5_index_table_remove(c, row, position))
+		{
+			db5_index_invalidate();
+			return;
+		}
+	}
+
+	db5_index_table_count--;
+}
+
+void db5_index_update_row(const uint32_t position, const db5_row *row)
+{
+	const db5_row *old;
+	unsigned int c;
+
+	check(row != NULL);
+
+	if (!db5_index_valid)
+	{
+		return;
+	}
+
+	old = db5_dat_row(position);
+	if (old == NULL)
+	{
+		db5_index_invalidate();
+		return;
+	}
+
+	/* only columns whose entry changes are sorted again */
+	for(c=0; c < columns_count; c++)
+	{
+		if (old->hidden == row->hidden && memcmp(((const char *)old)+db5_index_columns[c].offset,
+			((const char *)row)+db5_index_columns[c].offset, db5_index_columns[c].size) == 0)
+		{
+			continue;
+		}
+
+		if (!db5_index_table_remove(c, old, position))
+		{
+			db5_index_invalidate();
+			return;
+		}
+		db5_index_table_insert(c, row, position, db5_index_table_count-1);
+	}
+}
+
+void db5_index_invalidate()
+{
+	db5_index_set_tables(NULL, 0);
+}
+
+/**
+ * @brief find a string column and build searched key, as stored in database
+ * @param code index code of column
+ * @param value searched value - latin1
+ * @param prefix true to find values starting by value
+ * @param search receives a row holding the key
+ * @param length receives number of bytes of key to compare
+ * @return column number, columns_count if column is not a string index
+ */
+static unsigned int db5_index_search_key(const uint32_t code, const char *value, const bool prefix, db5_row *search, size_t *length)
+{
+	const db5_index_column *column;
+	char *key;
+	unsigned int c;
+
+	for(c=0; c < columns_count && db5_index_columns[c].code != code; c++);
+	if (c == columns_count || !db5_index_columns[c].wide)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]select", "column '%c%c%c%c' is not a string index\n",
+			byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+		return columns_count;
+	}
+	column = &db5_index_columns[c];
+
+	memset(search, 0, sizeof(db5_row));
+	key = ((char *)search)+column->offset;
+	strncpy(key, value, column->size/2);
+	ws_atows(key, column->size);
+
+	*length = (prefix ? 2*strlen(value) : column->size);
+	if (*length > column->size)
+	{
+		*length = column->size;
+	}
+
+	return c;
+}
+
+int db5_index_select(const uint32_t code, const char *value, const bool prefix, uint32_t **positions, uint32_t *count)
+{
+	const db5_index_column *column;
+	const index_entry *table;
+	db5_row search;
+	const char *key;
+	size_t length;
+	uint32_t first, last, i;
+	unsigned int c;
+
+	check(value != NULL);
+	check(positions != NULL);
+	check(count != NULL);
+
+	*positions = NULL;
+	*count = 0;
+
+	c = db5_index_search_key(code, value, prefix, &search, &length);
+	if (c == columns_count)
+	{
+		return DB5_INDEX_SELECT_ERROR;
+	}
+	column = &db5_index_columns[c];
+	key = ((const char *)&search)+column->offset;
+
+	pthread_mutex_lock(&db5_index_lock);
+
+	/* tables are not sorted again while database is still too large for them */
+	if (!db5_index_valid && db5_index_on_disk && db5_index_memory(db5_hdr_count()) > CONFIG_DB5_INDEX_MEMORY)
+	{
+		pthread_mutex_unlock(&db5_index_lock);
+		return DB5_INDEX_SELECT_UNAVAILABLE;
+	}
+
+	if (!db5_index_valid && !db5_index_build_tables(false))
+	{
+		pthread_mutex_unlock(&db5_index_lock);
+		add_log(ADDLOG_FAIL, "[db5/index]select", "unable to load indexes\n");
+		return DB5_INDEX_SELECT_ERROR;
+	}
+
+	if (db5_index_on_disk)
+	{
+		pthread_mutex_unlock(&db5_index_lock);
+		return DB5_INDEX_SELECT_UNAVAILABLE;
+	}
+
+	/* key padded with zeros is lower than all keys starting by it */
+	table = db5_index_tables[c];
+	first = db5_index_search(c, &search, 0, db5_index_table_count);
+	for(last = first; last < db5_index_table_count
+		&& memcmp(((const char *)db5_dat_row(table[last].position))+column->offset, key, length) == 0; last++);
+
+	if (last > first)
+	{
+		*positions = (uint32_t *)malloc(sizeof(uint32_t)*(last-first));
+		if (*positions == NULL)
+		{
+			pthread_mutex_unlock(&db5_index_lock);
+			add_log(ADDLOG_FAIL, "[db5/index]select", "not enought memory (%u entries)\n", last-first);
+			return DB5_INDEX_SELECT_ERROR;
+		}
+
+		for(i = first; i < last; i++)
+		{
+			(*positions)[i-first] = table[i].position;
+		}
+		*count = last-first;
+	}
+
+	pthread_mutex_unlock(&db5_index_lock);
+
+	return DB5_INDEX_SELECT_OK;
+}
+
+bool db5_index_scan(const uint32_t code, const char *value, const bool prefix, uint32_t **positions, uint32_t *count)
+{
+	const db5_index_column *column;
+	const db5_row *row;
+	index_entry *entries;
+	index_keys keys;
+	db5_row search;
+	const char *key;
+	char *data, *more_data;
+	uint32_t *found, *more;
+	size_t length;
+	uint32_t rows, size, number, i;
+	unsigned int c;
+	bool result;
+
+	check(value != NULL);
+	check(positions != NULL);
+	check(count != NULL);
+
+	*positions = NULL;
+	*count = 0;
+
+	c = db5_index_search_key(code, value, prefix, &search, &length);
+	if (c == columns_count)
+	{
+		return false;
+	}
+	column = &db5_index_columns[c];
+	key = ((const char *)&search)+column->offset;
+
+	/* matching rows and their keys, in row order */
+	rows = db5_hdr_count();
+	found = NULL;
+	data = NULL;
+	size = 0;
+	number = 0;
+	result = true;
+	for(i=0; result && i < rows; i++)
+	{
+		row = db5_dat_row(i);
+		if (row == NULL || db5_dat_deleted(i) || memcmp(((const char *)row)+column->offset, key, length) != 0)
+		{
+			continue;
+		}
+
+		if (number == size)
+		{
+			size = 2*size + 64;
+			more = (uint32_t *)realloc(found, sizeof(uint32_t)*size);
+			found = (more != NULL ? more : found);
+			more_data = (char *)realloc(data, column->size*size);
+			data = (more_data != NULL ? more_data : data);
+			result = (more != NULL && more_data != NULL);
+			if (!result)
+			{
+				break;
+			}
+		}
+
+		found[number] = i;
+		memcpy(data+(size_t)number*column->size, ((const char *)row)+column->offset, column->size);
+		number++;
+	}
+
+	/* rows are returned in index order */
+	entries = NULL;
+	if (result && number > 0)
+	{
+		entries = (index_entry *)malloc(sizeof(index_entry)*number);
+		result = (entries != NULL);
+	}
+	if (result && number > 0)
+	{
+		for(i=0; i < number; i++)
+		{
+			entries[i].hidden = 0;
+			entries[i].position = i;
+			entries[i].uid = 0;
+		}
+
+		keys.data = data;
+		keys.size = column->size;
+		db5_index_sort_entries(entries, number, &keys, false);
+
+		/* entries hold rank of match, replaced by row position */
+		for(i=0; i < number; i++)
+		{
+			entries[i].position = found[entries[i].position];
+		}
+		for(i=0; i < number; i++)
+		{
+			found[i] = entries[i].position;
+		}
+
+		*positions = found;
+		*count = number;
+		found = NULL;
+	}
+
+	if (!result)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]scan", "not enought memory (%u entries)\n", number);
+	}
+
+	free(entries);
+	free(data);
+	free(found);
+
+	return result;
+}
+
+db5_index_snapshot *db5_index_snapshot_take()
+{
+	db5_index_snapshot *snapshot;
+	unsigned int c, copied;
+	bool result;
+
+	pthread_mutex_lock(&db5_index_lock);
+
+	/* a full sort is left to db5_index_index_all */
+	if (!db5_index_valid || db5_index_table_count != db5_hdr_count())
+	{
+		pthread_mutex_unlock(&db5_index_lock);
+		return NULL;
+	}
+
+	snapshot = (db5_index_snapshot *)calloc(1, sizeof(db5_index_snapshot));
+	result = (snapshot != NULL);
+	for(c=0, copied=0; result && c < columns_count; c++)
+	{
+		if (!db5_index_dirty[c])
+		{
+			continue;
+		}
+
+		snapshot->tables[c] = (index_entry *)malloc(sizeof(index_entry)*(db5_index_table_count > 0 ? db5_index_table_count : 1));
+		result = (snapshot->tables[c] != NULL);
+		if (result)
+		{
+			memcpy(snapshot->tables[c], db5_index_tables[c], sizeof(index_entry)*db5_index_table_count);
+			snapshot->generation[c] = db5_index_generation[c];
+			copied++;
+		}
+	}
+
+	pthread_mutex_unlock(&db5_index_lock);
+
+	if (!result)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]snapshot", "not enought memory (%u entries)\n", db5_index_table_count);
+		db5_index_snapshot_free(snapshot);
+		return NULL;
+	}
+
+	if (copied == 0)
+	{
+		free(snapshot);
+		return NULL;
+	}
+
+	snapshot->count = db5_index_table_count;
+
+	return snapshot;
+}
+
+bool db5_index_snapshot_write(db5_index_snapshot *snapshot)
+{
+	bool written[columns_count];
+	unsigned int c, number;
+	uint32_t code;
+	bool result;
+
+	check(snapshot != NULL);
+
+	result = true;
+	for(c=0, number=0; c < columns_count; c++)
+	{
+		written[c] = false;
+		if (snapshot->tables[c] == NULL)
+		{
+			continue;
+		}
+
+		code = db5_index_columns[c].code;
+		written[c] = db5_index_write_table(code, snapshot->tables[c], snapshot->count);
+		result = result && written[c];
+		number++;
+	}
+
+	/* columns modified during writing stay dirty */
+	db5_dat_read_lock();
+	pthread_mutex_lock(&db5_index_lock);
+	for(c=0; c < columns_count; c++)
+	{
+		if (written[c] && db5_index_generation[c] == snapshot->generation[c])
+		{
+			db5_index_dirty[c] = false;
+		}
+	}
+	pthread_mutex_unlock(&db5_index_lock);
+	db5_dat_read_unlock();
+
+	add_log(ADDLOG_NOTICE, "[db5/index]snapshot", "%u index files written in background\n", number);
+	db5_index_fingerprint_save();
+
+	db5_index_snapshot_free(snapshot);
+
+	return result;
+}
+
+void db5_index_snapshot_free(db5_index_snapshot *snapshot)
+{
+	unsigned int c;
+
+	if (snapshot == NULL)
+	{
+		return;
+	}
+
+	for(c=0; c < columns_count; c++)
+	{
+		free(snapshot->tables[c]);
+	}
+	free(snapshot);
+}
+
+bool db5_index_sort_keys(const char *data, const size_t size, const uint32_t count, uint32_t *positions, const bool radix)
+{
+	index_entry *entries;
+	index_keys keys;
+	uint32_t i;
+
+	check(data != NULL);
+	check(positions != NULL);
+
+	entries = (index_entry *)malloc(sizeof(index_entry)*(count > 0 ? count : 1));
+	if (entries == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/index]sort", "not enought memory (%u entries)\n", count);
+		return false;
+	}
+
+	for(i=0; i < count; i++)
+	{
+		entries[i].hidden = 0;
+		entries[i].position = i;
+		entries[i].uid = 0;
+	}
+
+	keys.data = data;
+	keys.size = size;
+	db5_index_sort_entries(entries, count, &keys, radix);
+
+	for(i=0; i < count; i++)
+	{
+		positions[i] = entries[i].position;
+	}
+
+	free(entries);
+
+	return true;
+}
+
+bool db5_index_index_column(const ptrdiff_t reloffset, const size_t size, const uint32_t code)
+{
+	db5_index_column column;
+	uint32_t count;
+	bool result;
+
+	check(reloffset < sizeof(db5_row));
+	check(reloffset+size <= sizeof(db5_row));
+
+	column.code = code;
+	column.offset = reloffset;
+	column.size = size;
+	column.wide = false;
+
+	result = db5_index_build(&column, 1, NULL, &count, true);
+	db5_index_fingerprint_save();
+
+	return result;
+}
+
+bool db5_index_index_all()
+{
+	unsigned int c, skipped;
+	uint32_t code;
+	bool result;
+
+	pthread_mutex_lock(&db5_index_lock);
+
+	if (db5_hdr_count() == 0)
+	{
+		add_log(ADDLOG_NOTICE, "[db5/index]index_col", "no data to index\n");
+	}
+
+	/* tables are sorted: index files of modified columns are a plain dump */
+	if (db5_index_valid && db5_index_table_count == db5_hdr_count())
+	{
+		result = true;
+		for(c=0, skipped=0; c < columns_count; c++)
+		{
+			code = db5_index_columns[c].code;
+			if (!db5_index_dirty[c])
+			{
+				add_log(ADDLOG_DEBUG, "[db5/index]index", "index '%c%c%c%c' is unchanged, not written\n",
+					byteof(code, 0), byteof(code, 1), byteof(code, 2), byteof(code, 3));
+				skipped++;
+				continue;
+			}
+
+			if (db5_index_write_table(code, db5_index_tables[c], db5_index_table_count))
+			{
+				db5_index_dirty[c] = false;
+			}
+			else
+			{
+				result = false;
+			}
+		}
+
+		add_log(ADDLOG_NOTICE, "[db5/index]index", "%u index files written, %u unchanged\n", columns_count-skipped, skipped);
+	}
+	else
+	{
+		add_log(ADDLOG_DEBUG, "[db5/index]index", "tables are out of date, sorting all columns\n");
+		result = db5_index_build_tables(true);
+	}
+
+	db5_index_fingerprint_save();
+
+	pthread_mutex_unlock(&db5_index_lock);
+
+	return result;
+}
+
+uint64_t db5_index_bytes_written(const uint32_t code)
+{
+	uint64_t result;
+	unsigned int c;
+
+	pthread_mutex_lock(&db5_index_lock);
+	c = db5_index_column_of(code);
+	result = (c < columns_count ? db5_index_written[c] : 0);
+	pthread_mutex_unlock(&db5_index_lock);
+
+	return result;
+}
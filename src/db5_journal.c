@@ -0,0 +1,456 @@
+/**
+ * @file db5_journal.c
+ * @brief Source - Database db5, write-ahead journal
+ * @author Julien Blitte
+ * @version 0.1
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "config.h"
+#include "crc32.h"
+#include "db5_dat.h"
+#include "db5_hdr.h"
+#include "db5_journal.h"
+#include "db5_types.h"
+#include "file.h"
+#include "logger.h"
+#include "names.h"
+
+/**
+ * @brief journal record header, followed by record data
+ */
+typedef struct
+{
+	/** @brief crc32 of record, this field excluded */
+	uint32_t checksum;
+	/** @brief record type */
+	uint32_t type;
+	/** @brief row position, row count or commit sequence */
+	uint32_t index;
+	/** @brief size of data following the header */
+	uint32_t size;
+} db5_journal_record;
+
+/** @brief size of record data in journal, padded so that next header is aligned */
+#define db5_journal_padded(size)	(((size_t)(size)+3) & ~(size_t)3)
+
+/** @brief Journal file */
+static FILE *db5_journal;
+
+/** @brief Records waiting to be commited */
+static char *db5_journal_buffer;
+
+/** @brief Size of db5_journal_buffer */
+static size_t db5_journal_buffer_size;
+
+/** @brief Size of records waiting to be commited */
+static size_t db5_journal_pending;
+
+/** @brief Size of records of finished operations, first part of pending records */
+static size_t db5_journal_closed;
+
+/** @brief Number of operations in progress */
+static unsigned int db5_journal_depth;
+
+/** @brief Size of commited records in journal file */
+static uint32_t db5_journal_written;
+
+/** @brief Sequence number of last commit */
+static uint32_t db5_journal_sequence;
+
+/** @brief Date of last commit */
+static time_t db5_journal_date;
+
+/** @brief Journal is being replayed, nothing is logged */
+static bool db5_journal_replaying;
+
+/** @brief Lock of pending records and journal file */
+static pthread_mutex_t db5_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief fill a record header
+ * @param record the record, followed by its data
+ * @param type record type
+ * @param index record index
+ * @param size size of data
+ */
+static void db5_journal_fill(db5_journal_record *record, const uint32_t type, const uint32_t index, const uint32_t size)
+{
+	record->type = type;
+	record->index = index;
+	record->size = size;
+	record->checksum = crc32((const char *)&record->type, sizeof(db5_journal_record)-sizeof(uint32_t)+size);
+}
+
+/**
+ * @brief append a record to pending records
+ * @param type record type
+ * @param index record index
+ * @param data record data
+ * @param size size of data
+ */
+static void db5_journal_append(const uint32_t type, const uint32_t index, const void *data, const uint32_t size)
+{
+	db5_journal_record *record;
+	size_t needed;
+	char *buffer;
+
+	if (db5_journal == NULL || db5_journal_replaying)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&db5_journal_lock);
+
+	needed = db5_journal_pending + sizeof(db5_journal_record) + db5_journal_padded(size);
+	if (needed > db5_journal_buffer_size)
+	{
+		buffer = (char *)realloc(db5_journal_buffer, 2*needed);
+		if (buffer == NULL)
+		{
+			pthread_mutex_unlock(&db5_journal_lock);
+			add_log(ADDLOG_FAIL, "[db5/journal]append", "not enought memory, record %u is lost\n", type);
+			return;
+		}
+		db5_journal_buffer = buffer;
+		db5_journal_buffer_size = 2*needed;
+	}
+
+	record = (db5_journal_record *)(db5_journal_buffer + db5_journal_pending);
+	if (size > 0)
+	{
+		memcpy(record+1, data, size);
+	}
+	memset(((char *)(record+1))+size, 0, db5_journal_padded(size)-size);
+	db5_journal_fill(record, type, index, size);
+
+	db5_journal_pending = needed;
+
+	/* record outside of an operation */
+	if (db5_journal_depth == 0)
+	{
+		db5_journal_closed = db5_journal_pending;
+	}
+
+	pthread_mutex_unlock(&db5_journal_lock);
+}
+
+bool db5_journal_init()
+{
+	crc32_init();
+
+	db5_journal = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_JNL_FILE, "rb+");
+	if (db5_journal == NULL)
+	{
+		db5_journal = file_fcaseopen(CONFIG_DB5_DATA_DIR, CONFIG_DB5_JNL_FILE, "wb+");
+	}
+
+	if (db5_journal == NULL)
+	{
+		add_log(ADDLOG_CRITICAL, "[db5/journal]init", "unable to open journal\n");
+		return false;
+	}
+
+	db5_journal_buffer = NULL;
+	db5_journal_buffer_size = 0;
+	db5_journal_pending = 0;
+	db5_journal_closed = 0;
+	db5_journal_depth = 0;
+	db5_journal_written = file_filesize_f(db5_journal);
+	db5_journal_sequence = 0;
+	db5_journal_date = time(NULL);
+	db5_journal_replaying = false;
+
+	return true;
+}
+
+void db5_journal_free()
+{
+	if (db5_journal_pending > 0)
+	{
+		add_log(ADDLOG_RECOVER, "[db5/journal]free", "%u bytes of records were not commited\n", db5_journal_pending);
+	}
+
+	free(db5_journal_buffer);
+	db5_journal_buffer = NULL;
+
+	fclose(db5_journal);
+	db5_journal = NULL;
+}
+
+/**
+ * @brief apply a journal record to database
+ * @param record the record to apply, followed by its data
+ * @return true if successfull
+ */
+static bool db5_journal_apply(const db5_journal_record *record)
+{
+	char shortname[PATH_MAX];
+	const char *data;
+
+	data = (const char *)(record+1);
+
+	switch(record->type)
+	{
+		case DB5_JOURNAL_ROW:
+			if (record->size != sizeof(db5_row))
+			{
+				return false;
+			}
+			return db5_dat_restore_row(record->index, (const db5_row *)data);
+		case DB5_JOURNAL_DELETE:
+			return db5_dat_restore_delete(record->index);
+		case DB5_JOURNAL_COUNT:
+			return db5_dat_restore_count(record->index);
+		case DB5_JOURNAL_NAME_INSERT:
+			if (!names_select_shortname(data, shortname, sizeof(shortname)))
+			{
+				names_insert(data);
+			}
+			return true;
+		case DB5_JOURNAL_NAME_DELETE:
+			names_delete(data);
+			return true;
+		case DB5_JOURNAL_COMMIT:
+			return true;
+	}
+
+	return false;
+}
+
+uint32_t db5_journal_replay()
+{
+	const db5_journal_record *record;
+	char *journal;
+	size_t size, offset, last_commit;
+	uint32_t applied;
+
+	size = file_filesize_f(db5_journal);
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	journal = (char *)malloc(size);
+	if (journal == NULL)
+	{
+		add_log(ADDLOG_FAIL, "[db5/journal]replay", "not enought memory (%u bytes)\n", size);
+		return 0;
+	}
+
+	rewind(db5_journal);
+	if (fread(journal, size, 1, db5_journal) != 1)
+	{
+		add_log(ADDLOG_FAIL, "[db5/journal]replay", "unable to read journal\n");
+		free(journal);
+		return 0;
+	}
+
+	/* find end of last complete commit */
+	last_commit = 0;
+	offset = 0;
+	while(offset + sizeof(db5_journal_record) <= size)
+	{
+		record = (const db5_journal_record *)(journal + offset);
+		if (record->size > size - offset - sizeof(db5_journal_record)
+			|| db5_journal_padded(record->size) > size - offset - sizeof(db5_journal_record))
+		{
+			break;
+		}
+		if (record->checksum != crc32((const char *)&record->type, sizeof(db5_journal_record)-sizeof(uint32_t)+record->size))
+		{
+			break;
+		}
+
+		offset += sizeof(db5_journal_record) + db5_journal_padded(record->size);
+
+		if (record->type == DB5_JOURNAL_COMMIT)
+		{
+			last_commit = offset;
+		}
+	}
+
+	if (last_commit < size)
+	{
+		add_log(ADDLOG_RECOVER, "[db5/journal]replay", "%u bytes of uncommited records are ignored\n", size-last_commit);
+	}
+
+	/* redo commited records */
+	applied = 0;
+	db5_journal_replaying = true;
+	for(offset = 0; offset < last_commit; offset += sizeof(db5_journal_record) + db5_journal_padded(record->size))
+	{
+		record = (const db5_journal_record *)(journal + offset);
+
+		if (!db5_journal_apply(record))
+		{
+			add_log(ADDLOG_FAIL, "[db5/journal]replay", "unable to apply record %u (index %u)\n", record->type, record->index);
+		}
+		applied++;
+	}
+	db5_journal_replaying = false;
+
+	free(journal);
+
+	if (applied > 0)
+	{
+		add_log(ADDLOG_NOTICE, "[db5/journal]replay", "%u records recovered\n", applied);
+	}
+
+	return applied;
+}
+
+/**
+ * @brief write pending records of finished operations, journal lock must be held
+ * @return true if successfull
+ */
+static bool db5_journal_flush();
+
+void db5_journal_begin()
+{
+	pthread_mutex_lock(&db5_journal_lock);
+	db5_journal_depth++;
+	pthread_mutex_unlock(&db5_journal_lock);
+}
+
+void db5_journal_end()
+{
+	pthread_mutex_lock(&db5_journal_lock);
+
+	check(db5_journal_depth > 0);
+
+	if (db5_journal_depth > 0)
+	{
+		db5_journal_depth--;
+	}
+
+	if (db5_journal_depth == 0)
+	{
+		db5_journal_closed = db5_journal_pending;
+
+		/* group commit */
+		if (db5_journal_closed >= CONFIG_DB5_JOURNAL_GROUP_SIZE || time(NULL) - db5_journal_date >= CONFIG_DB5_JOURNAL_GROUP_DELAY)
+		{
+			db5_journal_flush();
+		}
+	}
+
+	pthread_mutex_unlock(&db5_journal_lock);
+}
+
+bool db5_journal_active()
+{
+	bool active;
+
+	pthread_mutex_lock(&db5_journal_lock);
+	active = (db5_journal_depth > 0);
+	pthread_mutex_unlock(&db5_journal_lock);
+
+	return active;
+}
+
+void db5_journal_row(const uint32_t index, const db5_row *row)
+{
+	check(row != NULL);
+
+	db5_journal_append(DB5_JOURNAL_ROW, index, row, sizeof(db5_row));
+}
+
+void db5_journal_delete(const uint32_t index)
+{
+	db5_journal_append(DB5_JOURNAL_DELETE, index, NULL, 0);
+}
+
+void db5_journal_count(const uint32_t count)
+{
+	db5_journal_append(DB5_JOURNAL_COUNT, count, NULL, 0);
+}
+
+void db5_journal_name(const uint32_t type, const char *longname)
+{
+	check(longname != NULL);
+	check(type == DB5_JOURNAL_NAME_INSERT || type == DB5_JOURNAL_NAME_DELETE);
+
+	db5_journal_append(type, 0, longname, strlen(longname)+1);
+}
+
+bool db5_journal_commit()
+{
+	bool result;
+
+	pthread_mutex_lock(&db5_journal_lock);
+	result = db5_journal_flush();
+	pthread_mutex_unlock(&db5_journal_lock);
+
+	return result;
+}
+
+static bool db5_journal_flush()
+{
+	db5_journal_record commit;
+
+	db5_journal_date = time(NULL);
+
+	if (db5_journal_closed == 0)
+	{
+		return true;
+	}
+
+	/* records of finished operations, then commit record, then a single flush */
+	db5_journal_fill(&commit, DB5_JOURNAL_COMMIT, db5_journal_sequence+1, 0);
+
+	if (fseek(db5_journal, db5_journal_written, SEEK_SET) != 0
+		|| fwrite(db5_journal_buffer, db5_journal_closed, 1, db5_journal) != 1
+		|| fwrite(&commit, sizeof(commit), 1, db5_journal) != 1
+		|| fflush(db5_journal) != 0
+		|| fdatasync(fileno(db5_journal)) != 0)
+	{
+		add_log(ADDLOG_FAIL, "[db5/journal]commit", "unable to write journal\n");
+		return false;
+	}
+
+	db5_journal_sequence++;
+	db5_journal_written += db5_journal_closed + sizeof(commit);
+
+	add_log(ADDLOG_DEBUG, "[db5/journal]commit", "commit %u, %u bytes\n", db5_journal_sequence, db5_journal_closed);
+
+	/* keep records of running operations */
+	memmove(db5_journal_buffer, db5_journal_buffer+db5_journal_closed, db5_journal_pending-db5_journal_closed);
+	db5_journal_pending -= db5_journal_closed;
+	db5_journal_closed = 0;
+
+	return true;
+}
+
+bool db5_journal_checkpoint()
+{
+	pthread_mutex_lock(&db5_journal_lock);
+
+	if (!file_truncate(db5_journal, 0))
+	{
+		pthread_mutex_unlock(&db5_journal_lock);
+		add_log(ADDLOG_FAIL, "[db5/journal]checkpoint", "unable to empty journal\n");
+		return false;
+	}
+
+	db5_journal_written = 0;
+
+	pthread_mutex_unlock(&db5_journal_lock);
+
+	return true;
+}
+
+uint32_t db5_journal_size()
+{
+	return db5_journal_written;
+}
+
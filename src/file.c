@@ -6,6 +6,7 @@
  */
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -52,6 +53,21 @@ off_t file_filesize_f(FILE *file)
 	return filestat.st_size;
 }
 
+off_t file_filesize_d(const int fd)
+{
+	struct stat filestat;
+
+	check(fd != -1);
+
+	if (fstat(fd, &filestat) != 0)
+	{
+		add_log(ADDLOG_FAIL, "[file]filesize_d", "unable to get stat information: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return filestat.st_size;
+}
+
 void file_path_explode(char *path, char **dir, char **file, char **ext)
 {
 	check(path != NULL);
@@ -144,11 +160,18 @@ void file_windows_slashes(char *path)
 	}
 }
 
-FILE *file_fcaseopen(const char *directory, const char *filename, const char *mode)
+/**
+ * @brief find the first file that match to specified filename without case sensitivity
+ * @param directory the directory where file must be found - utf8
+ * @param filename the filename to try to find - utf8
+ * @param filepath buffer where path of file is stored - utf8
+ * @param filepath_size size of filepath
+ * @return true if successfull
+ */
+static bool file_caseresolve(const char *directory, const char *filename, char *filepath, const size_t filepath_size)
 {
 	DIR *dir;
 	struct dirent *entry;
-	char filepath[PATH_MAX];
 
 	check(directory != NULL);
 	check(filename != NULL);
@@ -159,7 +182,7 @@ FILE *file_fcaseopen(const char *directory, const char *filename, const char *mo
 		add_log(ADDLOG_FAIL, "[file]fcaseopen", "unable to open directory\n");
 		log_dump("directory", directory);
 		log_dump("filename", filename);
-		return NULL;
+		return false;
 	}
 
 	entry = readdir(dir);
@@ -167,13 +190,13 @@ FILE *file_fcaseopen(const char *directory, const char *filename, const char *mo
 	{
 		if (strcasecmp(filename, entry->d_name) == 0)
 		{
-			closedir(dir);
 			add_log(ADDLOG_DUMP, "[file]fcaseopen", "resolved\n");
 			log_dump("filename", filename);
 			log_dump("entry", entry->d_name);
 
-			snprintf(filepath, sizeof(filepath), "%s/%s", directory, entry->d_name);
-			return fopen(filepath, mode);
+			snprintf(filepath, filepath_size, "%s/%s", directory, entry->d_name);
+			closedir(dir);
+			return true;
 		}
 		entry = readdir(dir);
 	}
@@ -183,10 +206,68 @@ FILE *file_fcaseopen(const char *directory, const char *filename, const char *mo
 	log_dump("filename", filename);
 	log_dump("directory", directory);
 
-	snprintf(filepath, sizeof(filepath), "%s/%s", directory, filename);
+	snprintf(filepath, filepath_size, "%s/%s", directory, filename);
+	return true;
+}
+
+FILE *file_fcaseopen(const char *directory, const char *filename, const char *mode)
+{
+	char filepath[PATH_MAX];
+
+	if (!file_caseresolve(directory, filename, filepath, sizeof(filepath)))
+	{
+		return NULL;
+	}
+
 	return fopen(filepath, mode);
 }
 
+int file_caseopen(const char *directory, const char *filename, const int flags)
+{
+	char filepath[PATH_MAX];
+
+	if (!file_caseresolve(directory, filename, filepath, sizeof(filepath)))
+	{
+		return -1;
+	}
+
+	return open(filepath, flags, 0644);
+}
+
+bool file_caserename(const char *directory, const char *oldname, const char *newname)
+{
+	char oldpath[PATH_MAX];
+	char newpath[PATH_MAX];
+
+	if (!file_caseresolve(directory, oldname, oldpath, sizeof(oldpath))
+		|| !file_caseresolve(directory, newname, newpath, sizeof(newpath)))
+	{
+		return false;
+	}
+
+	if (rename(oldpath, newpath) != 0)
+	{
+		add_log(ADDLOG_FAIL, "[file]caserename", "unable to rename file: %s\n", strerror(errno));
+		log_dump("oldname", oldname);
+		log_dump("newname", newname);
+		return false;
+	}
+
+	return true;
+}
+
+bool file_caseremove(const char *directory, const char *filename)
+{
+	char filepath[PATH_MAX];
+
+	if (!file_caseresolve(directory, filename, filepath, sizeof(filepath)))
+	{
+		return false;
+	}
+
+	return (unlink(filepath) == 0);
+}
+
 bool file_truncate(FILE *file, off_t len)
 {
 	int fd;
@@ -202,12 +202,11 @@ bool fsck_check_step3(const bool fix)
 	/* check if all files exists and refresh file infos */
 	for(i=0; i < real_count; i++)
 	{
-		if (db5_dat_select_row(i, &row) != true)
+		if (db5_dat_select_decoded(i, &row) != true)
 		{
 			add_log(ADDLOG_FAIL, "[fsck]step3", "unable to get file information form database, entry id: %u\n", i);
 			return NULL;
 		}
-		ws_wstoa(row.filename, membersizeof(db5_row, filename));
 
 		db5_shortname_to_localfile(row.filename, localfile, sizeof(localfile));
 
@@ -250,7 +249,8 @@ bool fsck_check_step4(const bool fix)
 	char filename_latin1[PATH_MAX];
 	char namebuffer[PATH_MAX];
 	char *dir, *file, *ext;
-	db5_row row;
+	db5_row *rows, *larger;
+	uint32_t rows_count, rows_size;
 
 	music = opendir(CONFIG_MUSIC_PATH);
 	if (music == NULL)
@@ -259,6 +259,11 @@ bool fsck_check_step4(const bool fix)
 		return false;
 	}
 
+	/* orphan rows are inserted all at once */
+	rows = NULL;
+	rows_count = 0;
+	rows_size = 0;
+
 	entry = readdir(music);
 	while(entry != NULL)
 	{
@@ -283,28 +288,34 @@ bool fsck_check_step4(const bool fix)
 
 					if (fix)
 					{
+						if (rows_count == rows_size)
+						{
+							rows_size = (rows_size == 0 ? 64 : 2*rows_size);
+							larger = (db5_row *)realloc(rows, rows_size*sizeof(db5_row));
+							if (larger == NULL)
+							{
+								add_log(ADDLOG_FAIL, "[fsck]step4", "not enought memory (%u entries)\n", rows_size);
+								free(rows), closedir(music);
+								return false;
+							}
+							rows = larger;
+						}
+
 						/* generate information */
 						db5_shortname_to_localfile(filename_latin1, namebuffer, sizeof(namebuffer));
-						if (db5_generate_row(namebuffer, &row) != true)
+						if (db5_generate_row(namebuffer, &rows[rows_count]) != true)
 						{
 							add_log(ADDLOG_FAIL, "[fsck]step4", "unable to generate row from file '%s'\n", namebuffer);
+							free(rows), closedir(music);
 							return false;
 						}
-						db5_widechar_row(&row);
+						db5_widechar_row(&rows[rows_count]);
 
 						/* if first char of filename is a dot, flag up the hidden field */
-						row.hidden = (uint32_t)(filename_latin1[0] == '.');
+						rows[rows_count].hidden = (uint32_t)(filename_latin1[0] == '.');
 
-						/* insert row */
-						if (db5_dat_insert(&row) != true)
-						{
-							add_log(ADDLOG_FAIL, "[fsck]step4", "unable to insert row in database '%s'\n", namebuffer);
-							return false;
-						}
-						else
-						{
-							add_log(ADDLOG_NOTICE, "[fsck]step4", "file '%s' added\n", namebuffer);
-						}
+						add_log(ADDLOG_NOTICE, "[fsck]step4", "file '%s' will be added\n", namebuffer);
+						rows_count++;
 					}
 				}
 			}
@@ -313,6 +324,20 @@ bool fsck_check_step4(const bool fix)
 		entry = readdir(music);
 	}
 	closedir(music);
+
+	/* insert rows */
+	if (db5_dat_insert_many(rows, rows_count) != true)
+	{
+		add_log(ADDLOG_FAIL, "[fsck]step4", "unable to insert %u rows in database\n", rows_count);
+		free(rows);
+		return false;
+	}
+	else if (rows_count > 0)
+	{
+		add_log(ADDLOG_NOTICE, "[fsck]step4", "%u files added\n", rows_count);
+	}
+
+	free(rows);
 	return true;
 }
 
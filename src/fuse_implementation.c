@@ -59,11 +59,6 @@ char *fuse_device;
 /** @brief Datetime of mount */
 static time_t fuse_mount_date;
 
-/** @brief Real name of current file */
-static char fuse_localfile[PATH_MAX];
-/** @brief Last error, get from errno */
-static int fuse_error;
-
 /* unmount fuse file system on error */
 static void fuse_impl_exit()
 {
@@ -97,6 +92,9 @@ void *fuse_impl_init (struct fuse_conn_info *fs_attr)
 		fuse_impl_exit();
 	}
 
+	/* indexes are written while device is idle, unmount has then less to do */
+	db5_idle_start();
+
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]init", "done.\n");
 
 	return NULL;
@@ -107,6 +105,11 @@ void fuse_impl_destroy (void *data)
 {
 	if (fuse_device != NULL)
 	{
+		db5_idle_stop();
+
+		add_log(ADDLOG_OPERATION, "[fuse]destroy", "writing database\n");
+		db5_sync();
+
 		add_log(ADDLOG_OPERATION, "[fuse]destroy", "building indexes\n");
 		db5_index();
 	}
@@ -121,6 +124,9 @@ void fuse_impl_destroy (void *data)
 /* create and open a file */
 int fuse_impl_create (const char *path, mode_t mode, struct fuse_file_info *filedata)
 {
+	char localfile[PATH_MAX];
+	int error;
+
 	check(path != NULL);
 	check(filedata != NULL);
 
@@ -137,33 +143,36 @@ int fuse_impl_create (const char *path, mode_t mode, struct fuse_file_info *file
 	}
 
 	/* insert file */
+	db5_begin();
 	if (!db5_insert(file_remove_headslash(path)))
 	{
+		db5_end();
 		add_log(ADDLOG_FAIL, "[fuse]create", "unable to insert file '%s' in database\n", path);
 		/* filesystem error */
 		return -EIO;
 	}
+	db5_end();
 
 	/* retrieve local file */
-	if (!db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)))
+	if (!db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)))
 	{
 		add_log(ADDLOG_FAIL, "[fuse]create", "unable to retrieve local file of '%s'\n", path);
 		/* filesystem error */
 		return -EIO;
 	}
 
-	add_log(ADDLOG_DUMP, "[fuse]create", "$path -> $localfile\n", path, fuse_localfile);
+	add_log(ADDLOG_DUMP, "[fuse]create", "$path -> $localfile\n", path, localfile);
 	log_dump("path", path);
-	log_dump("localfile", fuse_localfile);
+	log_dump("localfile", localfile);
 
 	/* open file */
-	filedata->fh = open(fuse_localfile, filedata->flags, 0644);
+	filedata->fh = open(localfile, filedata->flags, 0644);
 	if (filedata->fh == -1)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]open", "open fail: '%s'\n", strerror(fuse_error));
+		error = errno;
+		add_log(ADDLOG_FAIL, "[fuse]open", "open fail: '%s'\n", strerror(error));
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]create", "done.\n");
@@ -175,15 +184,17 @@ int fuse_impl_create (const char *path, mode_t mode, struct fuse_file_info *file
 /* change the access and modification times */
 int fuse_impl_utimens (const char *path, const struct timespec tv[2])
 {
+	char localfile[PATH_MAX];
+	int error;
 	struct utimbuf time;
 
 	check(path != NULL);
 
 	add_log(ADDLOG_OPERATION, "[fuse]utimens", "called, args='%s',(%u,%u)\n", path, tv[0], tv[1]);
 
-	if (db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)) != true)
+	if (db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)) != true)
 	{
-		add_log(ADDLOG_USER_ERROR, "[fuse]utimens", "file '%s' does not exists\n", fuse_localfile);
+		add_log(ADDLOG_USER_ERROR, "[fuse]utimens", "file '%s' does not exists\n", localfile);
 		/* file does not exists */
 		return -ENOENT;
 	}
@@ -191,16 +202,16 @@ int fuse_impl_utimens (const char *path, const struct timespec tv[2])
 	time.actime = tv[0].tv_sec;
 	time.modtime = tv[1].tv_sec;
 
-	if (utime(fuse_localfile, &time) != 0)
+	if (utime(localfile, &time) != 0)
 	{
-		fuse_error = errno;
+		error = errno;
 		add_log(ADDLOG_FAIL, "[fuse]utimens", "unable to set access/modification time\n");
 		log_dump("path", path);
-		log_dump("localfile", fuse_localfile);
+		log_dump("localfile", localfile);
 
-		add_log(ADDLOG_FAIL, "[fuse]utimens", "utime: 0x%x '%s'\n", fuse_error, strerror(fuse_error));
+		add_log(ADDLOG_FAIL, "[fuse]utimens", "utime: 0x%x '%s'\n", error, strerror(error));
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]utimens", "done.\n");
@@ -212,6 +223,8 @@ int fuse_impl_utimens (const char *path, const struct timespec tv[2])
 /* file attributes */
 int fuse_impl_getattr(const char *path, struct stat *attr)
 {
+	char localfile[PATH_MAX];
+	int error;
 	struct stat localattr;
 
 	check(path != NULL);
@@ -247,21 +260,21 @@ int fuse_impl_getattr(const char *path, struct stat *attr)
 
 	attr->st_ino = 0;
 
-	if (!db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)))
+	if (!db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)))
 	{
 		add_log(ADDLOG_USER_ERROR, "[fuse]getattr", "unable to find local file for '%s'\n", path);
 		/* file does not exists */
 		return -ENOENT;
 	}
 
-	if (stat(fuse_localfile, &localattr) != 0)
+	if (stat(localfile, &localattr) != 0)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]getattr", "unable to get information from local file: %s\n", strerror(fuse_error));
-		log_dump("localfile", fuse_localfile);
+		error = errno;
+		add_log(ADDLOG_FAIL, "[fuse]getattr", "unable to get information from local file: %s\n", strerror(error));
+		log_dump("localfile", localfile);
 		log_dump("path", path);
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	/* file size */
@@ -288,28 +301,35 @@ int fuse_impl_getattr(const char *path, struct stat *attr)
 /* remove a file */
 int fuse_impl_unlink (const char *path)
 {
+	char localfile[PATH_MAX];
+	int error;
+
 	check(path != NULL);
 
 	add_log(ADDLOG_OPERATION, "[fuse]unlink", "called, args='%s'\n", path);
 
-	if (!db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)))
+	if (!db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)))
 	{
 		add_log(ADDLOG_USER_ERROR, "[fuse]unlink", "unable to find file '%s'\n", path);
 		/* file does not exists */
 		return -ENOENT;
 	}
 
+	db5_begin();
 	if (!db5_delete(file_remove_headslash(path)))
 	{
+		db5_end();
 		add_log(ADDLOG_FAIL, "[fuse]unlink", "unable to remove file '%s' from database\n", path);
 		/* filesystem error */
 		return -EIO;
 	}
+	db5_end();
 
-	if (unlink(fuse_localfile) != 0)
+	if (unlink(localfile) != 0)
 	{
-		add_log(ADDLOG_RECOVER, "[fuse]unlink", "unable to remove local file: %s\n", strerror(fuse_error));
-		log_dump("localfile", fuse_localfile);
+		error = errno;
+		add_log(ADDLOG_RECOVER, "[fuse]unlink", "unable to remove local file: %s\n", strerror(error));
+		log_dump("localfile", localfile);
 		log_dump("path", path);
 	}
 
@@ -322,7 +342,9 @@ int fuse_impl_unlink (const char *path)
 /* rename a file */
 int fuse_impl_rename (const char *path, const char *newname)
 {
+	char localfile[PATH_MAX];
 	char localfile_new[PATH_MAX];
+	int error;
 
 	check(path != NULL);
 	check(newname != NULL);
@@ -344,16 +366,20 @@ int fuse_impl_rename (const char *path, const char *newname)
 	}
 
 	/* path localname */
-	if (!db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)))
+	if (!db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)))
 	{
 		add_log(ADDLOG_FAIL, "[fuse]rename", "unable to locate local file of '%s'\n", path);
 		/* filesystem error */
 		return -EIO;
 	}
 
+	/* database modifications are journaled as a single operation */
+	db5_begin();
+
 	/* insert new file in database */
 	if (!db5_insert(file_remove_headslash(newname)))
 	{
+		db5_end();
 		add_log(ADDLOG_FAIL, "[fuse]rename", "unable to insert '%s' in database\n", newname);
 		/* filesystem error */
 		return -EIO;
@@ -362,29 +388,41 @@ int fuse_impl_rename (const char *path, const char *newname)
 	/* retrieve name of new entry */
 	if (!db5_localfile(file_remove_headslash(newname), localfile_new, sizeof(localfile_new)))
 	{
+		/* nothing of a failed rename is commited */
+		db5_delete(file_remove_headslash(newname));
+		db5_end();
 		add_log(ADDLOG_FAIL, "[fuse]rename", "unable to locate local file of '%s'\n", newname);
 		/* filesystem error */
 		return -EIO;
 	}
 
 	add_log(ADDLOG_DEBUG, "[fuse]rename", "renaming local file\n");
-	log_dump("source", fuse_localfile);
+	log_dump("source", localfile);
 	log_dump("destination", localfile_new);
 
 	/* rename old file */
-	if (rename(fuse_localfile, localfile_new) != 0)
+	if (rename(localfile, localfile_new) != 0)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]rename", "unable to rename local file: %s\n", strerror(fuse_error));
-		log_dump("source", fuse_localfile);
+		error = errno;
+		db5_delete(file_remove_headslash(newname));
+		db5_end();
+		add_log(ADDLOG_FAIL, "[fuse]rename", "unable to rename local file: %s\n", strerror(error));
+		log_dump("source", localfile);
 		log_dump("destination", localfile_new);
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	/* remove source from database */
 	if (!db5_delete(file_remove_headslash(path)))
 	{
+		/* source keeps its local file and its entry */
+		if (rename(localfile_new, localfile) != 0)
+		{
+			add_log(ADDLOG_RECOVER, "[fuse]rename", "unable to restore local file: %s\n", strerror(errno));
+		}
+		db5_delete(file_remove_headslash(newname));
+		db5_end();
 		add_log(ADDLOG_FAIL, "[fuse]rename", "unable to remove '%s' in database\n", path);
 		/* filesystem error */
 		return -EIO;
@@ -392,6 +430,7 @@ int fuse_impl_rename (const char *path, const char *newname)
 
 	/* update database entry */
 	db5_update(file_remove_headslash(newname));
+	db5_end();
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]rename", "done.\n");
 
@@ -402,25 +441,28 @@ int fuse_impl_rename (const char *path, const char *newname)
 /* change the size of a file */
 int fuse_impl_truncate (const char *path, off_t newsize)
 {
+	char localfile[PATH_MAX];
+	int error;
+
 	check(path != NULL);
 
 	add_log(ADDLOG_OPERATION, "[fuse]truncate", "called, args='%s', %u\n", path, newsize);
 
-	if (!db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)))
+	if (!db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)))
 	{
 		add_log(ADDLOG_USER_ERROR, "[fuse]truncate", "unable to find file '%s'\n", path);
 		/* file does not exists */
 		return -ENOENT;
 	}
 
-	if (truncate(fuse_localfile, newsize) != 0)
+	if (truncate(localfile, newsize) != 0)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]truncate", "unable to truncate local file: %s\n", strerror(fuse_error));
-		log_dump("localfile", fuse_localfile);
+		error = errno;
+		add_log(ADDLOG_FAIL, "[fuse]truncate", "unable to truncate local file: %s\n", strerror(error));
+		log_dump("localfile", localfile);
 		log_dump("path", path);
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]truncate", "done.\n");
@@ -432,12 +474,15 @@ int fuse_impl_truncate (const char *path, off_t newsize)
 /* open a file */
 int fuse_impl_open(const char *path, struct fuse_file_info *filedata)
 {
+	char localfile[PATH_MAX];
+	int error;
+
 	check(path != NULL);
 	check(filedata != NULL);
 
 	add_log(ADDLOG_OPERATION, "[fuse]open", "called, args='%s'\n", path);
 
-	if (db5_localfile(file_remove_headslash(path), fuse_localfile, sizeof(fuse_localfile)) != true)
+	if (db5_localfile(file_remove_headslash(path), localfile, sizeof(localfile)) != true)
 	{
 		add_log(ADDLOG_USER_ERROR, "[fuse]open", "unable to find file '%s'\n", path);
 		/* file does not exists */
@@ -445,14 +490,14 @@ int fuse_impl_open(const char *path, struct fuse_file_info *filedata)
 	}
 
 
-	filedata->fh = open(fuse_localfile, filedata->flags);
+	filedata->fh = open(localfile, filedata->flags);
 
 	if (filedata->fh == -1)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]open", "open fail: '%s'\n", strerror(fuse_error));
+		error = errno;
+		add_log(ADDLOG_FAIL, "[fuse]open", "open fail: '%s'\n", strerror(error));
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]open", "done.\n");
@@ -464,6 +509,7 @@ int fuse_impl_open(const char *path, struct fuse_file_info *filedata)
 /* read data from an open file */
 int fuse_impl_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *filedata)
 {
+	int error;
 	int file;
 	int result;
 	
@@ -484,22 +530,14 @@ int fuse_impl_read(const char *path, char *buf, size_t size, off_t offset, struc
 
 	file = filedata->fh;
 
-	if (lseek(file, offset, SEEK_SET) == (off_t)-1)
-	{
-		fuse_error = errno;
-		add_log(ADDLOG_USER_ERROR, "[fuse]read", "read fail: '%s'\n", strerror(fuse_error));
-		/* io error */
-		errno = fuse_error;
-		return 0;
-	}
-
-	result = read(file, buf, size);
+	/* positional i/o: no file offset is shared between threads */
+	result = pread(file, buf, size, offset);
 	if (result == -1)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_USER_ERROR, "[fuse]read", "read fail: '%s'\n", strerror(fuse_error));
+		error = errno;
+		add_log(ADDLOG_USER_ERROR, "[fuse]read", "read fail: '%s'\n", strerror(error));
 		/* io error */
-		errno = fuse_error;
+		errno = error;
 		return 0;
 	}
 
@@ -511,6 +549,7 @@ int fuse_impl_read(const char *path, char *buf, size_t size, off_t offset, struc
 /* write data to an open file */
 int fuse_impl_write (const char *path, const char *data, size_t size, off_t offset, struct fuse_file_info *filedata)
 {
+	int error;
 	int file;
 	int result;
 
@@ -531,22 +570,14 @@ int fuse_impl_write (const char *path, const char *data, size_t size, off_t offs
 
 	file = filedata->fh;
 
-	if (lseek(file, offset, SEEK_SET) == (off_t)-1)
-	{
-		fuse_error = errno;
-		add_log(ADDLOG_USER_ERROR, "[fuse]write", "write fail: '%s'\n", strerror(fuse_error));
-		/* io error */
-		errno = fuse_error;
-		return 0;
-	}
-
-	result = write(file, data, size);
+	/* positional i/o: no file offset is shared between threads */
+	result = pwrite(file, data, size, offset);
 	if (result == -1)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_USER_ERROR, "[fuse]write", "write fail: '%s'\n", strerror(fuse_error));
+		error = errno;
+		add_log(ADDLOG_USER_ERROR, "[fuse]write", "write fail: '%s'\n", strerror(error));
 		/* io error */
-		errno = fuse_error;
+		errno = error;
 		return 0;
 	}
 
@@ -558,6 +589,8 @@ int fuse_impl_write (const char *path, const char *data, size_t size, off_t offs
 /* get file system statistics */
 int fuse_impl_statfs (const char *path, struct statvfs *stat)
 {
+	int error;
+
 	check(path != NULL);
 	check(stat != NULL);
 
@@ -565,10 +598,10 @@ int fuse_impl_statfs (const char *path, struct statvfs *stat)
 
 	if (statvfs(CONFIG_DB5_DATA_DIR, stat) != 0)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]statfs", "error during statfs: '%s'\n", strerror(fuse_error));
+		error = errno;
+		add_log(ADDLOG_FAIL, "[fuse]statfs", "error during statfs: '%s'\n", strerror(error));
 		/* io error */
-		return -fuse_error;
+		return -error;
 	}
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]statfs", "done.\n");
@@ -587,10 +620,12 @@ int fuse_impl_flush (const char *path, struct fuse_file_info *filedata)
 	add_log(ADDLOG_OPERATION, "[fuse]flush", "called, args='%s'\n", path);
 
 	/* try to update database */
+	db5_begin();
 	if (db5_update(file_remove_headslash(path)) != true)
 	{
 		add_log(ADDLOG_RECOVER, "[fuse]flush", "unable to update database for '%s'\n", path);
 	}
+	db5_end();
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]flush", "done.\n");
 
@@ -648,18 +683,28 @@ int fuse_impl_readdir(const char *path, void *data, fuse_fill_dir_t filler, off_
 /* flush opened file */
 int fuse_impl_fsync(const char *path, int inode, struct fuse_file_info *filedata)
 {
+	int error;
+
 	check(path != NULL);
 	check(filedata != NULL);
 	check((int)filedata->fh != 0);
 
 	add_log(ADDLOG_OPERATION, "[fuse]fsync", "called, args='%s'\n", path);
 
-	if (fsync((int)filedata->fh == -1))
+	if (fsync((int)filedata->fh) == -1)
+	{
+		error = errno;
+		add_log(ADDLOG_FAIL, "[fuse]fsync", "sync fail: '%s'\n", strerror(error));
+		/* io error */
+		return -error;
+	}
+
+	/* write database modifications */
+	if (db5_sync() != true)
 	{
-		fuse_error = errno;
-		add_log(ADDLOG_FAIL, "[fuse]fsync", "sync fail: '%s'\n", strerror(fuse_error));
+		add_log(ADDLOG_FAIL, "[fuse]fsync", "unable to write database\n");
 		/* io error */
-		return -fuse_error;
+		return -EIO;
 	}
 
 	add_log(ADDLOG_OP_SUCCESS, "[fuse]fsync", "done.\n");
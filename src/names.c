@@ -4,12 +4,18 @@
  * @author Julien Blitte
  * @version 0.1
  */
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "check.h"
 #include "config.h"
@@ -20,6 +26,29 @@
 #include "names.h"
 #include "utf8.h"
 
+/*
+ * Names file format, one record per pair of CRLF terminated lines:
+ *   <crc32 of shortname, hex><extension>
+ *   <longname, latin1>
+ * A record whose first line starts with NAMES_DELETE_MARKER removes the
+ * first entry of its longname. Delete records are only appended between
+ * two compactions: names file is rewritten without them when db5 is
+ * mounted or unmounted, so readers unaware of them only see live entries
+ * unless db5 has not been unmounted cleanly since last deletion.
+ */
+
+/** @brief first character of a delete record in names file, instead of crc32 */
+#define NAMES_DELETE_MARKER	"-"
+
+/** @brief size of memory blocks of names arenas */
+#define names_block_size	65536
+/** @brief smallest size class of longnames, as a power of 2 */
+#define names_string_class_min	4
+/** @brief number of size classes of longnames */
+#define names_string_classes	(sizeof(size_t)*8)
+/** @brief expected size of a record of names file */
+#define names_record_size	64
+
 /**
  * @brief node of name translation linked list
  */
@@ -29,66 +58,379 @@ typedef struct name_trans_t
 	uint32_t crc32;
 	/** @brief original name - latin1 */
 	char *longname;
+	/** @brief hash of longname, key of names_by_longname */
+	uint32_t hash;
 	/** @brief link to next entry */
 	struct name_trans_t *next;
+	/** @brief link to previous entry */
+	struct name_trans_t *previous;
+	/** @brief next entry of same bucket in names_by_crc */
+	struct name_trans_t *crc_next;
+	/** @brief next entry of same bucket in names_by_longname */
+	struct name_trans_t *longname_next;
 } name_trans;
 
+/**
+ * @brief memory block of names arenas, followed by its data
+ */
+typedef struct names_block_t
+{
+	/** @brief link to next block */
+	struct names_block_t *next;
+	/** @brief keep data aligned */
+	size_t unused;
+} names_block;
+
+/**
+ * @brief arena, memory is taken from the end of last block
+ */
+typedef struct
+{
+	/** @brief free memory of last block */
+	char *data;
+	/** @brief size of free memory of last block */
+	size_t size;
+} names_arena;
+
 /** @brief linked list of name translation */
 static name_trans *head, *tail;
 
+/** @brief all memory blocks, freed at once */
+static names_block *names_blocks;
+
+/** @brief arena of entries, entries are contiguous */
+static names_arena names_nodes;
+
+/** @brief arena of longnames */
+static names_arena names_strings;
+
+/** @brief free-list of deleted entries, linked by next */
+static name_trans *names_free_nodes;
+
+/** @brief free-lists of deleted longnames, by size class, linked in their first bytes */
+static char *names_free_strings[names_string_classes];
+
+/** @brief hash table of entries by crc32, buckets are in list order */
+static name_trans **names_by_crc;
+
+/** @brief hash table of entries by longname, buckets are in list order */
+static name_trans **names_by_longname;
+
+/** @brief number of buckets of hash tables, a power of 2 */
+static uint32_t names_buckets;
+
+/** @brief number of entries */
+static uint32_t names_count;
+
+/** @brief names file, records are appended to it */
+static FILE *names_file;
+
+/** @brief number of records of names file that are not live entries */
+static uint32_t names_garbage;
+
+/** @brief number of modifications not saved yet */
+static uint32_t names_changes;
+
+/** @brief number of saves avoided by saving several modifications at once */
+static uint32_t names_coalesced;
+
+/** @brief date of last save */
+static time_t names_save_date;
+
+/** @brief Lock of name translation list */
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static bool names_append(const name_trans *current, const bool deleted);
+static bool names_flush(const bool durable);
+static bool names_write();
+static void names_save_timer();
+
+/**
+ * @brief append an entry to its bucket in both hash tables
+ * @param entry the entry
+ */
+static void names_hash_add(name_trans *entry)
+{
+	name_trans **bucket;
+
+	entry->crc_next = NULL;
+	entry->longname_next = NULL;
+
+	/* buckets keep list order: first entry is found first, as in list */
+	for(bucket = &names_by_crc[entry->crc32 & (names_buckets-1)]; *bucket != NULL; bucket = &(*bucket)->crc_next);
+	*bucket = entry;
+
+	for(bucket = &names_by_longname[entry->hash & (names_buckets-1)]; *bucket != NULL; bucket = &(*bucket)->longname_next);
+	*bucket = entry;
+}
+
+/**
+ * @brief remove an entry from both hash tables
+ * @param entry the entry
+ */
+static void names_hash_remove(name_trans *entry)
+{
+	name_trans **bucket;
+
+	for(bucket = &names_by_crc[entry->crc32 & (names_buckets-1)]; *bucket != entry; bucket = &(*bucket)->crc_next);
+	*bucket = entry->crc_next;
+
+	for(bucket = &names_by_longname[entry->hash & (names_buckets-1)]; *bucket != entry; bucket = &(*bucket)->longname_next);
+	*bucket = entry->longname_next;
+}
+
+/**
+ * @brief resize hash tables, entries are hashed again in list order
+ * @param buckets new number of buckets, a power of 2
+ * @return true if successfull
+ */
+static bool names_hash_resize(const uint32_t buckets)
+{
+	name_trans **by_crc, **by_longname;
+	name_trans *current;
+
+	by_crc = (name_trans **)calloc(buckets, sizeof(name_trans *));
+	by_longname = (name_trans **)calloc(buckets, sizeof(name_trans *));
+	if (by_crc == NULL || by_longname == NULL)
+	{
+		add_log(ADDLOG_RECOVER, "[names]hash", "not enought memory for %u buckets\n", buckets);
+		free(by_crc);
+		free(by_longname);
+		return false;
+	}
+
+	free(names_by_crc);
+	free(names_by_longname);
+	names_by_crc = by_crc;
+	names_by_longname = by_longname;
+	names_buckets = buckets;
+
+	for(current = head; current != NULL; current = current->next)
+	{
+		names_hash_add(current);
+	}
+
+	return true;
+}
+
+/**
+ * @brief take memory from an arena
+ * @param arena the arena
+ * @param size size of memory, a multiple of pointer size
+ * @return memory, NULL if not enought memory
+ */
+static void *names_arena_alloc(names_arena *arena, const size_t size)
+{
+	names_block *block;
+	size_t block_size;
+	void *result;
+
+	if (size > arena->size)
+	{
+		block_size = (size > names_block_size ? size : names_block_size);
+		block = (names_block *)malloc(sizeof(names_block) + block_size);
+		if (block == NULL)
+		{
+			add_log(ADDLOG_CRITICAL, "[names]alloc", "not enought memory\n");
+			return NULL;
+		}
+		block->next = names_blocks;
+		names_blocks = block;
+
+		/* end of previous block is lost */
+		arena->data = (char *)(block+1);
+		arena->size = block_size;
+	}
+
+	result = arena->data;
+	arena->data += size;
+	arena->size -= size;
+
+	return result;
+}
+
+/**
+ * @brief get size class of a longname
+ * @param length length of longname
+ * @return size class, memory of longname is 2 power class
+ */
+static unsigned int names_string_class(const size_t length)
+{
+	unsigned int class;
+
+	for(class = names_string_class_min; ((size_t)1 << class) < length+1; class++);
+
+	return class;
+}
+
+/**
+ * @brief allocate an entry and its longname, deleted ones are reused first
+ * @param length length of longname
+ * @return the entry, NULL if not enought memory
+ */
+static name_trans *names_alloc_row(const size_t length)
+{
+	name_trans *entry;
+	unsigned int class;
+
+	class = names_string_class(length);
+
+	entry = names_free_nodes;
+	if (entry != NULL)
+	{
+		names_free_nodes = entry->next;
+	}
+	else
+	{
+		entry = (name_trans *)names_arena_alloc(&names_nodes, sizeof(name_trans));
+		if (entry == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	entry->longname = names_free_strings[class];
+	if (entry->longname != NULL)
+	{
+		names_free_strings[class] = *(char **)entry->longname;
+	}
+	else
+	{
+		entry->longname = (char *)names_arena_alloc(&names_strings, (size_t)1 << class);
+		if (entry->longname == NULL)
+		{
+			entry->next = names_free_nodes;
+			names_free_nodes = entry;
+			return NULL;
+		}
+	}
+
+	return entry;
+}
+
 /**
  * @brief insert a name translation in linked list
  * @param crc32 checksum of filename
- * @param long filename - latin1
+ * @param long filename - latin1, not necessarily nul terminated
+ * @param length length of filename
  */
-static void names_insert_full(const uint32_t crc32, const char *filename)
+static void names_insert_full(const uint32_t crc32, const char *filename, const size_t length)
 {
-	size_t length;
+	name_trans *entry;
 
 	check(crc32 != 0);
 	check(filename != NULL);
 
+	entry = names_alloc_row(length);
+	check(entry != NULL);
+
+	memcpy(entry->longname, filename, length);
+	entry->longname[length] = '\0';
+
+	entry->crc32 = crc32;
+	entry->hash = strcrc32(entry->longname);
+	entry->next = NULL;
+	entry->previous = tail;
+
 	if (head == NULL)
 	{
-		head = malloc(sizeof(name_trans));
-		check(head != NULL);
-
-		tail = head;
+		head = entry;
 	}
 	else
 	{
-		tail->next = malloc(sizeof(name_trans));
-		check(tail->next != NULL);
-
-		tail = tail->next;
+		tail->next = entry;
 	}
+	tail = entry;
+	names_count++;
 
-	length = strlen(filename);
-
-	tail->longname = malloc(length+1);
-	check(tail->longname != NULL);
-	strncpy(tail->longname, filename, length+1);
-
-	tail->crc32 = crc32;
-	tail->next = NULL;
+	/* tables grow with entries, a failure only makes buckets longer */
+	if (names_count > names_buckets)
+	{
+		if (names_hash_resize(2*names_buckets))
+		{
+			return;
+		}
+	}
+	names_hash_add(entry);
 }
 
 /**
- * @brief free a row from memory
+ * @brief put a row in free-lists, to be reused
  * @param current the row to free up
  */
 static void names_free_row(name_trans *current)
 {
+	unsigned int class;
+
 	check(current != NULL);
 
-	free(current->longname);
-	free(current);
+	class = names_string_class(strlen(current->longname));
+	*(char **)current->longname = names_free_strings[class];
+	names_free_strings[class] = current->longname;
+
+	current->next = names_free_nodes;
+	names_free_nodes = current;
+}
+
+/**
+ * @brief remove an entry from linked list and hash tables, and free it
+ * @param current the entry
+ */
+static void names_remove_full(name_trans *current)
+{
+	names_hash_remove(current);
+	if (current->previous != NULL)
+	{
+		current->previous->next = current->next;
+	}
+	else
+	{
+		head = current->next;
+	}
+	if (current->next != NULL)
+	{
+		current->next->previous = current->previous;
+	}
+	else
+	{
+		tail = current->previous;
+	}
+	names_free_row(current);
+	names_count--;
+}
+
+/**
+ * @brief retrieve entry of a complete name
+ * @param filename long filename - latin1
+ * @return first entry of filename, NULL if not found
+ */
+static name_trans *names_select_by_longname(const char *filename)
+{
+	name_trans *current;
+	uint32_t hash;
+
+	check(filename != NULL);
+
+	hash = strcrc32(filename);
+
+	current = names_by_longname[hash & (names_buckets-1)];
+	while(current != NULL)
+	{
+		if (current->hash == hash && strcmp(filename, current->longname) == 0)
+		{
+			return current;
+		}
+		current = current->longname_next;
+	}
+
+	return NULL;
 }
 
 bool names_select_shortname(const char *filename, char *shortname, const size_t shortname_size)
 {
 	name_trans *current;
 	const char *ext;
+	uint32_t crc32;
 
 	check(filename != NULL);
 	check(shortname != NULL);
@@ -107,22 +449,24 @@ bool names_select_shortname(const char *filename, char *shortname, const size_t
 		return false;
 	}
 
-	current = head;
-	while(current != NULL)
+	pthread_rwlock_rdlock(&names_lock);
+
+	current = names_select_by_longname(filename);
+	if (current == NULL)
 	{
-		if (strcmp(filename, current->longname) == 0)
-		{
-			/* generate filename using crc32 and original extension */
-			if (snprintf(shortname, shortname_size, "%x%s", current->crc32, ext) >= shortname_size)
-			{
-				return false;
-			}
-			return true;
-		}
-		current = current->next;
+		pthread_rwlock_unlock(&names_lock);
+		return false;
 	}
 
-	return false;
+	crc32 = current->crc32;
+	pthread_rwlock_unlock(&names_lock);
+
+	/* generate filename using crc32 and original extension */
+	if (snprintf(shortname, shortname_size, "%x%s", crc32, ext) >= shortname_size)
+	{
+		return false;
+	}
+	return true;
 }
 
 /**
@@ -136,63 +480,155 @@ static const char *names_select_by_crc(const uint32_t crc32)
 
 	check(crc32 != 0);
 
-	current = head;
+	current = names_by_crc[crc32 & (names_buckets-1)];
 	while(current != NULL)
 	{
 		if (current->crc32 == crc32)
 		{
 			return current->longname;
 		}
-		current = current->next;
+		current = current->crc_next;
 	}
 	return NULL;
 }
 
-bool names_init()
+/**
+ * @brief load records of names file, lines end with LF or CRLF
+ * @param data content of names file, not modified
+ * @param size size of data
+ */
+static void names_load(const char *data, const size_t size)
 {
-	char shortname[PATH_MAX], longname[PATH_MAX];
-	FILE *names;
-	int length;
+	char deleted[PATH_MAX];
+	const char *shortname, *longname, *end, *line_end, *next, *cut;
+	name_trans *current;
 	uint32_t crc32;
 
+	end = data + size;
+	for(shortname = data; shortname < end; shortname = next)
+	{
+		/* shortname line, a record is ignored if longname line is missing */
+		line_end = memchr(shortname, '\n', end-shortname);
+		if (line_end == NULL || line_end+1 == end)
+		{
+			break;
+		}
+		longname = line_end+1;
+
+		/* longname line, up to first CR or LF */
+		line_end = memchr(longname, '\n', end-longname);
+		if (line_end == NULL)
+		{
+			line_end = end;
+		}
+		next = line_end+1;
+		cut = memchr(longname, '\r', line_end-longname);
+		if (cut != NULL)
+		{
+			line_end = cut;
+		}
+
+		/* delete marker cancels first entry of the name */
+		if (shortname[0] == NAMES_DELETE_MARKER[0])
+		{
+			snprintf(deleted, sizeof(deleted), "%.*s", (int)(line_end-longname), longname);
+			current = names_select_by_longname(deleted);
+			if (current != NULL)
+			{
+				names_remove_full(current);
+				names_garbage++;
+			}
+			names_garbage++;
+			continue;
+		}
+
+		/* shortname line is followed by a LF, conversion stops before it */
+		crc32 = strtoul(shortname, NULL, 16);
+
+		names_insert_full(crc32, longname, line_end-longname);
+	}
+}
+
+bool names_init()
+{
+	struct stat info;
+	uint32_t buckets;
+	char *map;
+	int names;
+
 	crc32_init();
 
 	head = NULL;
 	tail = NULL;
+	names_count = 0;
+	names_blocks = NULL;
+	memset(&names_nodes, 0, sizeof(names_nodes));
+	memset(&names_strings, 0, sizeof(names_strings));
+	names_free_nodes = NULL;
+	memset(names_free_strings, 0, sizeof(names_free_strings));
+	names_file = NULL;
+	names_garbage = 0;
+	names_changes = 0;
+	names_coalesced = 0;
+	names_save_date = time(NULL);
+	names_by_crc = NULL;
+	names_by_longname = NULL;
+	if (!names_hash_resize(CONFIG_NAMES_BUCKETS))
+	{
+		add_log(ADDLOG_CRITICAL, "[names]init", "not enought memory\n");
+		return false;
+	}
 
-	names = file_fcaseopen(".", CONFIG_NAMES_FILE, "rt");
-	if (names == NULL)
+	/* file is parsed in a read-only mapping, longnames are copied out of it */
+	names = file_caseopen(".", CONFIG_NAMES_FILE, O_RDONLY);
+	if (names == -1 || fstat(names, &info) != 0)
 	{
 		add_log(ADDLOG_FAIL, "[names]init", "unable to load database\n");
 	}
-	else
+	else if (info.st_size > 0)
 	{
-		/* recycle variable 'shortname' */
-		while(!feof(names))
+		map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, names, 0);
+		if (map == MAP_FAILED)
 		{
-			if (fgets(shortname, sizeof(shortname), names) && fgets(longname, sizeof(longname), names))
+			add_log(ADDLOG_FAIL, "[names]init", "unable to map database\n");
+		}
+		else
+		{
+			madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+			/* tables are sized once, from an estimate of record count */
+			for(buckets = names_buckets; buckets < info.st_size/names_record_size; buckets *= 2);
+			if (buckets > names_buckets)
 			{
-				for(length = 0; longname[length] != '\0'; length++)
-				{
-					if ((longname[length] == '\r') || (longname[length] == '\n'))
-					{
-						longname[length] = '\0';
-						break;
-					}
-				}
-				crc32 = strtoul(shortname, NULL, 16);
-
-				names_insert_full(crc32, longname);
+				names_hash_resize(buckets);
 			}
+
+			names_load(map, info.st_size);
+			munmap(map, info.st_size);
 		}
-		fclose(names);
+	}
+	if (names != -1)
+	{
+		close(names);
 	}
 
 	if (head == NULL)
 	{
 		add_log(ADDLOG_NOTICE, "[names]init", "name database is empty\n");
 	}
-	
+
+	if (names_garbage > 0)
+	{
+		add_log(ADDLOG_NOTICE, "[names]init", "%u entries, %u dead records\n", names_count, names_garbage);
+	}
+
+	/* new records are appended, delete records left by a crash are compacted first */
+	names_file = file_fcaseopen(".", CONFIG_NAMES_FILE, "ab");
+	if (!((names_garbage == 0 || names_write()) && names_flush(false)))
+	{
+		add_log(ADDLOG_FAIL, "[names]init", "unable to open database for writing\n");
+	}
+
 	return true;
 }
 
@@ -207,39 +643,58 @@ void names_insert(const char *filename)
 	add_log(ADDLOG_DEBUG, "[names]insert", "insert a new file, crc32=%08x\n", crc32);
 	log_dump_latin1("filename", filename);
 
-	names_insert_full(crc32, filename);
+	pthread_rwlock_wrlock(&names_lock);
+
+	names_insert_full(crc32, filename, strlen(filename));
 
-	if (!names_save())
+	if (!names_append(tail, false))
 	{
 		add_log(ADDLOG_RECOVER, "[names]insert", "error while saving names list\n");
 		log_dump_latin1("filename", filename);
 	}
+	names_save_timer();
+
+	pthread_rwlock_unlock(&names_lock);
 
 	add_log(ADDLOG_DEBUG, "[names]insert", "done.\n");
 }
 
-const char *names_select_longname(const char *shortname)
+bool names_select_longname(const char *shortname, char *longname, const size_t longname_size)
 {
 	const char *result;
 	uint32_t crc32;
 
 	check(shortname != NULL);
+	check(longname != NULL);
+	check(longname_size > 0);
 
 	/* retrieve crc32 in the name */
 	crc32 = strtoul(shortname, NULL, 16);
 	if (crc32 == 0)
 	{
-		return shortname;
+		strncpy(longname, shortname, longname_size);
+		longname[longname_size-1] = '\0';
+		return false;
 	}
 
+	pthread_rwlock_rdlock(&names_lock);
+
 	/* locate the original long filename */
 	result = names_select_by_crc(crc32);
 	if (result == NULL)
 	{
-		return shortname;
+		pthread_rwlock_unlock(&names_lock);
+		strncpy(longname, shortname, longname_size);
+		longname[longname_size-1] = '\0';
+		return false;
 	}
 
-	return result;
+	strncpy(longname, result, longname_size);
+	longname[longname_size-1] = '\0';
+
+	pthread_rwlock_unlock(&names_lock);
+
+	return true;
 }
 
 bool names_generate_shortname(const char *longname, char *shortname, const size_t shortname_size)
@@ -265,92 +720,203 @@ bool names_generate_shortname(const char *longname, char *shortname, const size_
 	return true;
 }
 
-bool names_save()
+/**
+ * @brief write a record of an entry
+ * @param names names file
+ * @param current the entry
+ * @param deleted write a delete marker of the entry
+ * @return true if successfull
+ */
+static bool names_write_record(FILE *names, const name_trans *current, const bool deleted)
 {
 	char *ext;
-	FILE *names;
-	name_trans *current;
 
-	current = head;
+	check(current->longname != NULL);
+	ext = strrchr(current->longname, '.');
+
+	return (fprintf(names, "%s%x%s\r\n%s\r\n", deleted ? NAMES_DELETE_MARKER : "", current->crc32, ext, current->longname) > 0);
+}
+
+/**
+ * @brief write names data on a new file replacing names file, only live entries are kept
+ * @return true if successfull
+ */
+static bool names_write()
+{
+	name_trans *current;
+	FILE *names;
+	bool result;
 
-	names = file_fcaseopen(".", CONFIG_NAMES_FILE, "wb");
+	names = file_fcaseopen(".", CONFIG_NAMES_FILE ".tmp", "wb");
 	if (names == NULL)
 	{
 		add_log(ADDLOG_FAIL, "[names]save", "unable to save database\n");
 		return false;
 	}
 
-	while(current != NULL)
+	result = true;
+	for(current = head; current != NULL; current = current->next)
 	{
-		check(current->longname != NULL);
-		ext = strrchr(current->longname, '.');
-
-		fprintf(names, "%x%s\r\n%s\r\n", current->crc32, ext, current->longname);
+		result = names_write_record(names, current, false) && result;
+	}
 
-		current = current->next;
+	/* new file must be complete on disk before it replaces names file */
+	if (!result || fflush(names) != 0 || fsync(fileno(names)) != 0
+		|| !file_caserename(".", CONFIG_NAMES_FILE ".tmp", CONFIG_NAMES_FILE))
+	{
+		add_log(ADDLOG_FAIL, "[names]save", "unable to write database to disk\n");
+		fclose(names);
+		file_caseremove(".", CONFIG_NAMES_FILE ".tmp");
+		return false;
 	}
 
-	fclose(names);
+	add_log(ADDLOG_DEBUG, "[names]save", "%u dead records removed\n", names_garbage);
+	names_garbage = 0;
+
+	/* new records are appended to the new file */
+	if (names_file != NULL)
+	{
+		fclose(names_file);
+	}
+	names_file = names;
 
 	return true;
 }
 
+/**
+ * @brief append a record to names file buffer, record is written by next save
+ * @param current the entry inserted or deleted
+ * @param deleted entry is being deleted
+ * @return true if successfull
+ */
+static bool names_append(const name_trans *current, const bool deleted)
+{
+	/* deleted entry and its delete marker are both dead */
+	if (deleted)
+	{
+		names_garbage += 2;
+	}
+	names_changes++;
+
+	if (names_file == NULL)
+	{
+		return false;
+	}
+
+	return names_write_record(names_file, current, deleted);
+}
+
+/**
+ * @brief tell if names file must be written again
+ * @return true if names file is not open or has too many dead records
+ */
+static bool names_compact_needed()
+{
+	return (names_file == NULL
+		|| (uint64_t)names_garbage*100 > (uint64_t)(names_count+names_garbage)*CONFIG_NAMES_GARBAGE_RATIO);
+}
+
+/**
+ * @brief save modifications of names, names lock must be held for writing
+ * @param durable flush file to disk
+ * @return true if successfull
+ */
+static bool names_flush(const bool durable)
+{
+	bool result;
+
+	if (names_compact_needed())
+	{
+		result = names_write();
+	}
+	else
+	{
+		result = (fflush(names_file) == 0 && (!durable || fsync(fileno(names_file)) == 0));
+		if (!result)
+		{
+			add_log(ADDLOG_FAIL, "[names]save", "unable to write database to disk\n");
+		}
+	}
+
+	if (result)
+	{
+		if (names_changes > 1)
+		{
+			add_log(ADDLOG_DEBUG, "[names]save", "%u modifications saved at once\n", names_changes);
+			names_coalesced += names_changes-1;
+		}
+		names_changes = 0;
+	}
+	names_save_date = time(NULL);
+
+	return result;
+}
+
+/**
+ * @brief save modifications of names when they are kept in memory for too long
+ */
+static void names_save_timer()
+{
+	if (names_changes > 0 && time(NULL) - names_save_date >= CONFIG_NAMES_SAVE_DELAY)
+	{
+		names_flush(false);
+	}
+}
+
+bool names_save()
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&names_lock);
+	result = names_flush(false);
+	pthread_rwlock_unlock(&names_lock);
+
+	return result;
+}
+
+bool names_sync()
+{
+	bool result;
+
+	pthread_rwlock_wrlock(&names_lock);
+	result = names_flush(true);
+	pthread_rwlock_unlock(&names_lock);
+
+	return result;
+}
+
 bool names_delete(const char *filename)
 {
-	name_trans *previous;
 	name_trans *current;
 
 	check(filename != NULL);
 
-	previous = NULL;
-	current = head;
-	/* while we don't have finished cursing */
-	while(current != NULL)
+	pthread_rwlock_wrlock(&names_lock);
+
+	current = names_select_by_longname(filename);
+	if (current == NULL)
 	{
-		/* if filename is the correct one */
-		if (strcmp(filename, current->longname) == 0)
-		{
-			/* only one node */
-			if (head == current && tail == current)
-			{
-				head = NULL, tail = NULL;
-				names_free_row(current);
-			}
-			/* first node */
-			else if (head == current)
-			{
-				head = current->next;
-				names_free_row(current);
-			}
-			/* last node */
-			else if (tail == current)
-			{
-				tail = previous;
-				tail->next = NULL;
-				names_free_row(current);
-			}
-			/* general case */
-			else
-			{
-				previous->next = current->next;
-				names_free_row(current);
-			}
+		pthread_rwlock_unlock(&names_lock);
+		return false;
+	}
 
-			if (!names_save())
-			{
-				add_log(ADDLOG_RECOVER, "[names]insert", "error while saving names list\n");
-			}
-			return true;
-		}
-		previous = current, current = current->next;
+	if (!names_append(current, true))
+	{
+		add_log(ADDLOG_RECOVER, "[names]delete", "error while saving names list\n");
 	}
-	return false;
+	names_remove_full(current);
+	names_save_timer();
+
+	pthread_rwlock_unlock(&names_lock);
+	return true;
 }
 
 void names_print()
 {
 	name_trans *current;
 
+	pthread_rwlock_rdlock(&names_lock);
+
 	current = head;
 	while(current != NULL)
 	{
@@ -358,17 +924,50 @@ void names_print()
 		log_dump_latin1("current->filename", current->longname);
 		current = current->next;
 	}
+
+	pthread_rwlock_unlock(&names_lock);
 }
 
 void names_free()
 {
-	name_trans *current;
+	names_block *block;
 
-	while(head != NULL)
+	/* names file is left in its canonical form */
+	if (names_garbage > 0)
 	{
-		current = head;
-		head = head->next;
-		names_free_row(current);
+		names_write();
 	}
+	names_flush(true);
+	if (names_coalesced > 0)
+	{
+		add_log(ADDLOG_NOTICE, "[names]free", "%u saves coalesced\n", names_coalesced);
+	}
+	if (names_file != NULL)
+	{
+		fclose(names_file);
+		names_file = NULL;
+	}
+
+	/* entries and longnames are in arenas */
+	while(names_blocks != NULL)
+	{
+		block = names_blocks;
+		names_blocks = block->next;
+		free(block);
+	}
+	memset(&names_nodes, 0, sizeof(names_nodes));
+	memset(&names_strings, 0, sizeof(names_strings));
+	names_free_nodes = NULL;
+	memset(names_free_strings, 0, sizeof(names_free_strings));
+
+	head = NULL;
+	tail = NULL;
+	names_count = 0;
+
+	free(names_by_crc);
+	names_by_crc = NULL;
+	free(names_by_longname);
+	names_by_longname = NULL;
+	names_buckets = 0;
 }
 